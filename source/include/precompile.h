@@ -15,14 +15,18 @@
 #include <map>
 #include <deque>
 #include <array>
+#include <mutex>
 #include <atomic>
 #include <chrono>
+#include <future>
 #include <string>
 #include <vector>
 #include <thread>
+#include <tuple>
 #include <memory>
 #include <random>
 #include <utility>
+#include <stdexcept>
 #include <complex>
 #include <iostream>
 #include <optional>
@@ -32,14 +36,18 @@
 #include <string_view>
 #include <shared_mutex>
 #include <unordered_map>
+#include <condition_variable>
 
 #include "zpr.h"
 #include "zfu.h"
 
+#include "xsimd/xsimd.hpp"
+
 #include "xtensor/xio.hpp"
 #include "xtensor/xview.hpp"
 #include "xtensor/xadapt.hpp"
 #include "xtensor/xfixed.hpp"
+#include "xtensor/xnoalias.hpp"
 #include "xtensor/xarray.hpp"
 #include "xtensor/xrandom.hpp"
 #include "xtensor/xtensor.hpp"
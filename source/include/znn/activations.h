@@ -16,6 +16,10 @@ namespace znn::activations
 	// through the forward pass. so for example, d/dx (sigmoid) is sigmoid(x) * (1-sigmoid(x))
 	// but we compute [x * (1-x)], since x is already sigmoided.
 
+	// forward_inplace does the same thing as forward, but over a raw buffer of `count` values, so layers
+	// can apply the activation to their output while it's still in cache (see dense_infer in layers/dense.h).
+	// similarly, backward computes err * derivative(ys) in one pass, writing it to dst (which can be err).
+
 	struct Linear : Activation
 	{
 		xarr forward(const xarr& input)
@@ -25,7 +29,20 @@ namespace znn::activations
 
 		xarr derivative(const xarr& input)
 		{
-			return xt::ones<double>(input.shape());
+			return xt::ones<scalar_t>(input.shape());
+		}
+
+		void forward_inplace(scalar_t* xs, size_t count) const
+		{
+			(void) xs;
+			(void) count;
+		}
+
+		void backward(const scalar_t* ys, const scalar_t* err, scalar_t* dst, size_t count) const
+		{
+			(void) ys;
+			if(dst != err)
+				std::copy(err, err + count, dst);
 		}
 	};
 
@@ -33,30 +50,79 @@ namespace znn::activations
 	{
 		xarr forward(const xarr& input)
 		{
-			return xt::where(input <= 0, xt::zeros<double>(input.shape()), input);
+			return xt::where(input <= 0, scalar_t(0), input);
 		}
 
 		xarr derivative(const xarr& input)
 		{
-			return xt::where(input <= 0, xt::zeros<double>(input.shape()), xt::ones<double>(input.shape()));
+			return xt::where(input <= 0, scalar_t(0), scalar_t(1));
+		}
+
+		void forward_inplace(scalar_t* xs, size_t count) const
+		{
+			simd::map(xs, count,
+				[](auto x) { return xsimd::select(x <= decltype(x)(scalar_t(0)), decltype(x)(scalar_t(0)), x); },
+				[](auto x) { return (x <= 0 ? scalar_t(0) : x); }
+			);
+		}
+
+		void backward(const scalar_t* ys, const scalar_t* err, scalar_t* dst, size_t count) const
+		{
+			simd::zip(ys, err, dst, count,
+				[](auto y, auto e) { return xsimd::select(y <= decltype(y)(scalar_t(0)), decltype(e)(scalar_t(0)), e); },
+				[](auto y, auto e) { return (y <= 0 ? scalar_t(0) : e); }
+			);
 		}
 	};
 
 	struct Sigmoid : Activation
 	{
+		// if approximate is set, forward_inplace uses simd::approx_exp, so the relative error
+		// of the output is below 2e-7 (see there).
+		Sigmoid(bool approximate = false) : approximate(approximate) { }
+
 		xarr forward(const xarr& input)
 		{
-			return 1.0 / (1.0 + xt::exp(-input));
+			return scalar_t(1) / (scalar_t(1) + xt::exp(-input));
 		}
 
 		xarr derivative(const xarr& input)
 		{
-			return input * (1 - input);
+			return input * (scalar_t(1) - input);
 		}
+
+		void forward_inplace(scalar_t* xs, size_t count) const
+		{
+			if(this->approximate)
+			{
+				auto f = [](auto x) { return scalar_t(1) / (scalar_t(1) + simd::approx_exp(-x)); };
+				simd::map(xs, count, f, f);
+			}
+			else
+			{
+				simd::map(xs, count,
+					[](auto x) { return scalar_t(1) / (scalar_t(1) + xsimd::exp(-x)); },
+					[](auto x) { return scalar_t(1) / (scalar_t(1) + std::exp(-x)); }
+				);
+			}
+		}
+
+		void backward(const scalar_t* ys, const scalar_t* err, scalar_t* dst, size_t count) const
+		{
+			auto f = [](auto y, auto e) { return e * y * (scalar_t(1) - y); };
+			simd::zip(ys, err, dst, count, f, f);
+		}
+
+	private:
+		bool approximate = false;
 	};
 
 	struct TanH : Activation
 	{
+		// if approximate is set, forward_inplace computes tanh(x) = 1 - 2/(1 + e^2x) with simd::approx_exp,
+		// which gives an absolute error below 4e-7 (twice the relative error of the exp).
+		TanH(bool approximate = false) : approximate(approximate) { }
+
 		xarr forward(const xarr& input)
 		{
 			return xt::tanh(input);
@@ -64,7 +130,32 @@ namespace znn::activations
 
 		xarr derivative(const xarr& input)
 		{
-			return 1.0 - xt::square(input);
+			return scalar_t(1) - xt::square(input);
 		}
+
+		void forward_inplace(scalar_t* xs, size_t count) const
+		{
+			if(this->approximate)
+			{
+				auto f = [](auto x) { return scalar_t(1) - scalar_t(2) / (scalar_t(1) + simd::approx_exp(scalar_t(2) * x)); };
+				simd::map(xs, count, f, f);
+			}
+			else
+			{
+				simd::map(xs, count,
+					[](auto x) { return xsimd::tanh(x); },
+					[](auto x) { return std::tanh(x); }
+				);
+			}
+		}
+
+		void backward(const scalar_t* ys, const scalar_t* err, scalar_t* dst, size_t count) const
+		{
+			auto f = [](auto y, auto e) { return e * (scalar_t(1) - y * y); };
+			simd::zip(ys, err, dst, count, f, f);
+		}
+
+	private:
+		bool approximate = false;
 	};
 }
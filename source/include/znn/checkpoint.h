@@ -0,0 +1,51 @@
+// checkpoint.h
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#pragma once
+
+#include "util.h"
+
+namespace znn
+{
+	struct Layer;
+
+	/*
+		which activations Model keeps between the forward and the backward pass when it's training. by
+		default it keeps all of them, since the backward pass of every layer needs its input and (usually)
+		its output. with checkpointing, the layers are split into segments (by level, see Model::forward),
+		and only the outputs that leave a segment are kept; the rest are freed as soon as their segment
+		has run forward, then recomputed from the kept ones when backward gets to the segment. that's one
+		more forward pass (of everything but the last segment), for only needing about one segment's
+		worth of activations at a time, on top of the checkpoints. the buffers of the backward pass (the
+		errors that the layers pass back, and eg. Dense's gradient) are also freed as soon as they've been
+		used, instead of being kept around for the next pass.
+
+		sqrt:    segments of about sqrt(n) levels each, so that both the checkpoints and the segments are
+		         O(sqrt(n)) activations.
+
+		manual:  a segment ends after each of the given layers (so their outputs are the checkpoints).
+
+		recomputing gives exactly the same outputs as the first time (eg. BatchNorm uses the same batch
+		statistics, and Dropout the same mask; see Layer::recompute), so the gradients don't change.
+	*/
+	struct Checkpointing
+	{
+		enum class Kind { None, Sqrt, Manual };
+
+		Kind kind = Kind::None;
+		std::vector<const Layer*> layers;
+
+		static Checkpointing none() { return Checkpointing(); }
+		static Checkpointing sqrt() { return Checkpointing(Kind::Sqrt, { }); }
+
+		static Checkpointing manual(std::vector<const Layer*> checkpoints)
+		{
+			return Checkpointing(Kind::Manual, std::move(checkpoints));
+		}
+
+	private:
+		Checkpointing() { }
+		Checkpointing(Kind kind, std::vector<const Layer*> layers) : kind(kind), layers(std::move(layers)) { }
+	};
+}
@@ -0,0 +1,196 @@
+// dataset.h
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#pragma once
+
+#include "util.h"
+
+namespace znn
+{
+	/*
+		a set of (input, target) samples, packed back to back in two flat buffers -- instead of one
+		xarray (with its own heap allocation and shape vector) per sample. every input has the same
+		shape, and so does every target; the shapes are per-sample, ie. without the batch axis.
+
+		batches are made with gather, which copies the rows for a list of indices into a batch buffer
+		that the caller keeps around, so a training loop doesn't allocate anything per batch.
+
+		a dataset can also be a read-only view of memory that belongs to something else (eg. a file
+		mapped by io::mapNpy), in which case it can't be modified.
+	*/
+	struct Dataset
+	{
+		Dataset(std::vector<size_t> input_shape, std::vector<size_t> target_shape)
+			: input_shape(std::move(input_shape)), target_shape(std::move(target_shape))
+		{
+			auto count = [](const std::vector<size_t>& xs) -> size_t {
+				return std::accumulate(xs.begin(), xs.end(), (size_t) 1, std::multiplies<size_t>());
+			};
+
+			this->input_size = count(this->input_shape);
+			this->target_size = count(this->target_shape);
+		}
+
+		// a view of `count` samples that are already packed at `inputs` and `targets`. `backing` is whatever
+		// owns that memory; it's kept alive for as long as the dataset (or any copy of it) is. it can be null
+		// if the caller owns the memory, which then has to outlive the dataset.
+		Dataset(std::vector<size_t> input_shape, std::vector<size_t> target_shape, size_t count,
+			const scalar_t* inputs, const scalar_t* targets, std::shared_ptr<const void> backing)
+			: Dataset(std::move(input_shape), std::move(target_shape))
+		{
+			assert(inputs != nullptr && targets != nullptr);
+
+			this->count = count;
+			this->view_inputs = inputs;
+			this->view_targets = targets;
+			this->backing = std::move(backing);
+		}
+
+		// packs the given samples; they must all have the same shape (as must the targets).
+		Dataset(const std::vector<xarr>& inputs, const std::vector<xarr>& targets)
+			: Dataset(inputs.empty() ? std::vector<size_t>() : std::vector<size_t>(inputs[0].shape().begin(), inputs[0].shape().end()),
+				targets.empty() ? std::vector<size_t>() : std::vector<size_t>(targets[0].shape().begin(), targets[0].shape().end()))
+		{
+			assert(inputs.size() == targets.size());
+
+			this->reserve(inputs.size());
+			for(size_t i = 0; i < inputs.size(); i++)
+				this->add(inputs[i], targets[i]);
+		}
+
+		void reserve(size_t count)
+		{
+			assert(!this->isView());
+			this->inputs.reserve(count * this->input_size);
+			this->targets.reserve(count * this->target_size);
+		}
+
+		void add(const scalar_t* input, const scalar_t* target)
+		{
+			assert(!this->isView());
+			this->inputs.insert(this->inputs.end(), input, input + this->input_size);
+			this->targets.insert(this->targets.end(), target, target + this->target_size);
+			this->count++;
+		}
+
+		void add(const xarr& input, const xarr& target)
+		{
+			assert(input.size() == this->input_size && target.size() == this->target_size);
+
+			// make sure we copy them in row-major order, whatever their layout.
+			auto&& in = xt::view_eval<xt::layout_type::row_major>(input);
+			auto&& tg = xt::view_eval<xt::layout_type::row_major>(target);
+			this->add(in.data() + in.data_offset(), tg.data() + tg.data_offset());
+		}
+
+		// changes the number of samples; new ones are zeroed. shrinking keeps the memory around, so
+		// a Dataset can be reused as a buffer without reallocating.
+		void resize(size_t count)
+		{
+			assert(!this->isView());
+			this->inputs.resize(count * this->input_size);
+			this->targets.resize(count * this->target_size);
+			this->count = count;
+		}
+
+		void clear() { this->resize(0); }
+
+		size_t size() const { return this->count; }
+		bool empty() const { return this->count == 0; }
+		bool isView() const { return this->view_inputs != nullptr; }
+
+		const std::vector<size_t>& inputShape() const { return this->input_shape; }
+		const std::vector<size_t>& targetShape() const { return this->target_shape; }
+
+		// the number of scalars in each input and target.
+		size_t inputSize() const { return this->input_size; }
+		size_t targetSize() const { return this->target_size; }
+
+		const scalar_t* input(size_t i) const
+		{
+			return (this->isView() ? this->view_inputs : this->inputs.data()) + (i * this->input_size);
+		}
+
+		const scalar_t* target(size_t i) const
+		{
+			return (this->isView() ? this->view_targets : this->targets.data()) + (i * this->target_size);
+		}
+
+		// for filling in samples in-place (eg. after a resize); views are read-only.
+		scalar_t* mutableInput(size_t i) { assert(!this->isView()); return this->inputs.data() + (i * this->input_size); }
+		scalar_t* mutableTarget(size_t i) { assert(!this->isView()); return this->targets.data() + (i * this->target_size); }
+
+		// copies the samples at indices[0..count) into x and y, which become (count x input_shape...) and
+		// (count x target_shape...). they're only reallocated if their size changes.
+		void gather(const size_t* indices, size_t count, xarr& x, xarr& y) const
+		{
+			resize_batch(x, count, this->input_shape);
+			resize_batch(y, count, this->target_shape);
+
+			for(size_t i = 0; i < count; i++)
+			{
+				copy_row(x.data() + (i * this->input_size), this->input(indices[i]), this->input_size);
+				copy_row(y.data() + (i * this->target_size), this->target(indices[i]), this->target_size);
+			}
+		}
+
+		// same as gather, but for the contiguous run of samples [begin, begin + count); this is one copy.
+		void slice(size_t begin, size_t count, xarr& x) const
+		{
+			assert(begin + count <= this->count);
+
+			resize_batch(x, count, this->input_shape);
+			std::copy(this->input(begin), this->input(begin + count), x.data());
+		}
+
+		// copies sample i into x and y, with their unbatched shapes.
+		void sample(size_t i, xarr& x, xarr& y) const
+		{
+			if(!zfu::equal(x.shape(), this->input_shape))   x.resize(this->input_shape);
+			if(!zfu::equal(y.shape(), this->target_shape))  y.resize(this->target_shape);
+
+			copy_row(x.data(), this->input(i), this->input_size);
+			copy_row(y.data(), this->target(i), this->target_size);
+		}
+
+	private:
+		std::vector<size_t> input_shape;
+		std::vector<size_t> target_shape;
+
+		size_t input_size = 0;
+		size_t target_size = 0;
+		size_t count = 0;
+
+		aligned_vector inputs;
+		aligned_vector targets;
+
+		// only for views.
+		const scalar_t* view_inputs = nullptr;
+		const scalar_t* view_targets = nullptr;
+		std::shared_ptr<const void> backing;
+
+		static void resize_batch(xarr& x, size_t count, const std::vector<size_t>& shape)
+		{
+			bool same = (x.dimension() == shape.size() + 1) && (x.shape()[0] == count)
+				&& std::equal(shape.begin(), shape.end(), x.shape().begin() + 1);
+
+			if(!same)
+			{
+				auto s = std::vector<size_t>(shape.begin(), shape.end());
+				s.insert(s.begin(), count);
+				x.resize(s);
+			}
+		}
+
+		// the rows are usually short (a few dozen scalars), so we'd rather have the copy inlined than go
+		// through memcpy for each one.
+		static void copy_row(scalar_t* dst, const scalar_t* src, size_t n)
+		{
+			simd::each(n, [&](size_t i, auto lanes) {
+				using V = typename decltype(lanes)::type;
+				simd::store<V>(dst + i, simd::load<V>(src + i));
+			});
+		}
+	};
+}
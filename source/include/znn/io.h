@@ -0,0 +1,596 @@
+// io.h
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#pragma once
+
+#include "util.h"
+#include "dataset.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+	loading datasets from files without parsing or copying them: the file is memory-mapped, and the
+	Dataset is just a view of the mapping (see Dataset), so "loading" a multi-gigabyte file is instant,
+	the pages are read in lazily as training touches them, and they live in the page cache where
+	other processes mapping the same file can share them.
+
+	this works for numpy's .npy files, for .npz files that were saved uncompressed (np.savez, not
+	np.savez_compressed), and for our own format (see saveDataset). the data can only be used in-place
+	if it's already little-endian scalar_t in row-major order, aligned to a scalar_t; anything else (eg.
+	float32 when we're using doubles, or integer labels) still works, but gets converted into a normal
+	(owning) Dataset. .npy files are always aligned, but zip doesn't align the members of an .npz, so
+	those are usually converted -- use .npy or our own format for big datasets.
+
+	errors (missing files, malformed headers, compressed npz members) throw std::runtime_error.
+*/
+namespace znn::io
+{
+	// a read-only mapping of a whole file, which is unmapped when the last reference goes away.
+	struct MappedFile
+	{
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator = (const MappedFile&) = delete;
+
+		~MappedFile()
+		{
+			if(this->base != nullptr)
+				munmap(this->base, this->length);
+		}
+
+		const uint8_t* data() const { return static_cast<const uint8_t*>(this->base); }
+		size_t size() const { return this->length; }
+
+		static std::shared_ptr<MappedFile> open(const std::string& path)
+		{
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if(fd < 0)
+				throw std::runtime_error(zpr::sprint("could not open '%s'", path));
+
+			struct stat st;
+			if(fstat(fd, &st) != 0)
+			{
+				::close(fd);
+				throw std::runtime_error(zpr::sprint("could not stat '%s'", path));
+			}
+
+			auto ret = std::shared_ptr<MappedFile>(new MappedFile());
+			ret->length = (size_t) st.st_size;
+
+			if(ret->length > 0)
+			{
+				ret->base = mmap(nullptr, ret->length, PROT_READ, MAP_SHARED, fd, 0);
+				if(ret->base == MAP_FAILED)
+				{
+					ret->base = nullptr;
+					::close(fd);
+					throw std::runtime_error(zpr::sprint("could not map '%s'", path));
+				}
+			}
+
+			// the mapping stays valid after the descriptor is closed.
+			::close(fd);
+			return ret;
+		}
+
+	private:
+		MappedFile() { }
+
+		void* base = nullptr;
+		size_t length = 0;
+	};
+
+	// one array from a .npy file (or a member of an .npz), pointing into the mapped file.
+	struct NpyArray
+	{
+		std::vector<size_t> shape;
+
+		char kind = 0;          // 'f', 'i', 'u' or 'b', as in numpy's dtype.kind
+		size_t itemSize = 0;
+		bool fortranOrder = false;
+
+		const uint8_t* data = nullptr;
+		std::shared_ptr<MappedFile> file;
+
+		size_t size() const
+		{
+			return std::accumulate(this->shape.begin(), this->shape.end(), (size_t) 1, std::multiplies<size_t>());
+		}
+
+		// whether the data is already laid out exactly as scalar_t, so it can be used without a copy.
+		bool isScalarLayout() const
+		{
+			return this->kind == 'f' && this->itemSize == sizeof(scalar_t) && !this->fortranOrder
+				&& (reinterpret_cast<uintptr_t>(this->data) % alignof(scalar_t)) == 0;
+		}
+
+		// element i (in row-major order), converted to scalar_t. the dtype was already checked
+		// by parse_npy, so it's one of f4/f8, i1/2/4/8, u1/2/4/8 or b1.
+		scalar_t get(size_t i) const
+		{
+			auto p = this->data + (i * this->itemSize);
+			auto load = [p](auto x) -> scalar_t { std::memcpy(&x, p, sizeof(x)); return scalar_t(x); };
+
+			if(this->kind == 'f')
+				return (this->itemSize == 4 ? load(float()) : load(double()));
+
+			if(this->kind == 'i')
+			{
+				switch(this->itemSize)
+				{
+					case 1:  return load(int8_t());
+					case 2:  return load(int16_t());
+					case 4:  return load(int32_t());
+					default: return load(int64_t());
+				}
+			}
+
+			switch(this->itemSize)
+			{
+				case 1:  return load(uint8_t());
+				case 2:  return load(uint16_t());
+				case 4:  return load(uint32_t());
+				default: return load(uint64_t());
+			}
+		}
+	};
+
+	namespace impl
+	{
+		template <typename T>
+		inline T read_le(const uint8_t* p)
+		{
+			T ret = 0;
+			for(size_t i = 0; i < sizeof(T); i++)
+				ret |= (T) ((T) p[i] << (8 * i));
+
+			return ret;
+		}
+
+		// the size in bytes of `count` items of the given shape, each `item` bytes; the dims come from
+		// the file, so this is nullopt if they multiply out to more than fits in a size_t.
+		inline std::optional<size_t> byte_size(size_t count, const std::vector<size_t>& shape, size_t item)
+		{
+			size_t ret = item;
+			auto mul = [&ret](size_t x) {
+				if(x != 0 && ret > SIZE_MAX / x)
+					return false;
+
+				ret *= x;
+				return true;
+			};
+
+			if(!mul(count))
+				return std::nullopt;
+
+			for(size_t x : shape)
+			{
+				if(!mul(x))
+					return std::nullopt;
+			}
+
+			return ret;
+		}
+
+		// parses the header of the .npy at `ptr` (with `size` bytes).
+		inline NpyArray parse_npy(const uint8_t* ptr, size_t size, const std::string& name)
+		{
+			auto fail = [&](const char* why) {
+				return std::runtime_error(zpr::sprint("'%s': invalid npy (%s)", name, why));
+			};
+
+			if(size < 10 || std::memcmp(ptr, "\x93NUMPY", 6) != 0)
+				throw fail("bad magic");
+
+			// version 1 has a 2-byte header length, and 2 and 3 have a 4-byte one.
+			size_t major = ptr[6];
+			size_t header_start = (major == 1 ? 10 : 12);
+			size_t header_len = (major == 1 ? read_le<uint16_t>(ptr + 8) : read_le<uint32_t>(ptr + 8));
+
+			if(header_start + header_len > size)
+				throw fail("truncated header");
+
+			// the header is a python dict literal, eg. {'descr': '<f8', 'fortran_order': False, 'shape': (100, 3), }
+			auto header = std::string_view(reinterpret_cast<const char*>(ptr + header_start), header_len);
+			auto value_of = [&](std::string_view key) -> std::string_view {
+				auto k = header.find(key);
+				if(k == std::string_view::npos)
+					throw fail("missing key");
+
+				auto v = header.find(':', k + key.size());
+				if(v == std::string_view::npos)
+					throw fail("missing value");
+
+				return header.substr(v + 1);
+			};
+
+			NpyArray ret;
+
+			auto descr = value_of("'descr'");
+			auto q = descr.find('\'');
+			if(q == std::string_view::npos || q + 3 >= descr.size())
+				throw fail("bad descr");
+
+			char endian = descr[q + 1];
+			ret.kind = descr[q + 2];
+			ret.itemSize = (size_t) std::strtoul(std::string(descr.substr(q + 3, 2)).c_str(), nullptr, 10);
+
+			if(endian == '>' && ret.itemSize > 1)
+				throw fail("big-endian data is not supported");
+
+			// only the dtypes that NpyArray::get can convert.
+			bool pow2 = (ret.itemSize == 1 || ret.itemSize == 2 || ret.itemSize == 4 || ret.itemSize == 8);
+			bool supported = (ret.kind == 'f' && (ret.itemSize == 4 || ret.itemSize == 8))
+				|| ((ret.kind == 'i' || ret.kind == 'u') && pow2)
+				|| (ret.kind == 'b' && ret.itemSize == 1);
+
+			if(!supported)
+				throw fail("unsupported dtype");
+
+			ret.fortranOrder = (value_of("'fortran_order'").substr(0, 5).find("True") != std::string_view::npos);
+
+			auto shape = value_of("'shape'");
+			auto open = shape.find('(');
+			auto close = shape.find(')');
+			if(open == std::string_view::npos || close == std::string_view::npos)
+				throw fail("bad shape");
+
+			for(size_t i = open + 1; i < close; )
+			{
+				auto digit = [&](size_t k) { return '0' <= shape[k] && shape[k] <= '9'; };
+				if(digit(i))
+				{
+					size_t n = 0;
+					while(i < close && digit(i))
+						n = (n * 10) + (size_t) (shape[i++] - '0');
+
+					ret.shape.push_back(n);
+				}
+				else
+				{
+					i++;
+				}
+			}
+
+			ret.data = ptr + header_start + header_len;
+
+			auto bytes = byte_size(1, ret.shape, ret.itemSize);
+			if(!bytes || *bytes > size - (header_start + header_len))
+				throw fail("truncated data");
+
+			return ret;
+		}
+
+		// makes a Dataset out of two arrays whose first axis is the sample. it's a view if both of
+		// them can be used in place, otherwise their data is converted.
+		inline Dataset make_dataset(const NpyArray& x, const NpyArray& y)
+		{
+			if(x.shape.empty() || y.shape.empty() || x.shape[0] != y.shape[0])
+				throw std::runtime_error("inputs and targets must have the same number of samples");
+
+			// a 1-d array is one scalar per sample, which we treat as shape (1).
+			auto sample_shape = [](const NpyArray& a) -> std::vector<size_t> {
+				if(a.shape.size() == 1) return { 1 };
+				else                    return std::vector<size_t>(a.shape.begin() + 1, a.shape.end());
+			};
+
+			size_t count = x.shape[0];
+			if(x.isScalarLayout() && y.isScalarLayout())
+			{
+				// the two arrays might be in different files, so keep both of them alive.
+				auto files = std::make_shared<std::pair<std::shared_ptr<MappedFile>, std::shared_ptr<MappedFile>>>(x.file, y.file);
+
+				return Dataset(sample_shape(x), sample_shape(y), count, reinterpret_cast<const scalar_t*>(x.data),
+					reinterpret_cast<const scalar_t*>(y.data), std::move(files));
+			}
+
+			auto ret = Dataset(sample_shape(x), sample_shape(y));
+			ret.resize(count);
+
+			auto convert = [&](const NpyArray& a, scalar_t* out, size_t row) {
+				if(!a.fortranOrder)
+				{
+					for(size_t i = 0; i < count * row; i++)
+						out[i] = a.get(i);
+
+					return;
+				}
+
+				// column-major: element (n, i1, i2, ...) is at n + count * (i1 + d1 * (i2 + d2 * ...)), where
+				// d1, d2, ... are the sample's axes. work out where each element of a sample is (ie. without
+				// the n), going through the sample in row-major order.
+				auto dims = sample_shape(a);
+				auto offsets = std::vector<size_t>(row);
+				auto index = std::vector<size_t>(dims.size(), 0);
+
+				for(size_t j = 0; j < row; j++)
+				{
+					size_t ofs = 0;
+					for(size_t k = dims.size(); k-- > 0; )
+						ofs = (ofs * dims[k]) + index[k];
+
+					offsets[j] = ofs;
+
+					// the next index, with the last axis moving fastest.
+					for(size_t k = dims.size(); k-- > 0; )
+					{
+						if(++index[k] < dims[k])
+							break;
+
+						index[k] = 0;
+					}
+				}
+
+				for(size_t n = 0; n < count; n++)
+					for(size_t j = 0; j < row; j++)
+						out[n * row + j] = a.get(n + (count * offsets[j]));
+			};
+
+			convert(x, ret.mutableInput(0), ret.inputSize());
+			convert(y, ret.mutableTarget(0), ret.targetSize());
+			return ret;
+		}
+	}
+
+	inline NpyArray mapNpy(const std::string& path)
+	{
+		auto file = MappedFile::open(path);
+
+		auto ret = impl::parse_npy(file->data(), file->size(), path);
+		ret.file = std::move(file);
+		return ret;
+	}
+
+	// the members of an .npz, by name (without the .npy extension). every member must be stored
+	// uncompressed; np.savez does this, np.savez_compressed does not.
+	inline std::map<std::string, NpyArray> mapNpz(const std::string& path)
+	{
+		using impl::read_le;
+
+		auto file = MappedFile::open(path);
+		auto data = file->data();
+		auto size = file->size();
+
+		auto fail = [&](const std::string& why) {
+			return std::runtime_error(zpr::sprint("'%s': invalid npz (%s)", path, why));
+		};
+
+		// find the end-of-central-directory record; it's at the end, before a comment of up to 64k.
+		size_t eocd = SIZE_MAX;
+		if(size >= 22)
+		{
+			size_t lowest = (size > 22 + 65535 ? size - 22 - 65535 : 0);
+			for(size_t i = size - 22 + 1; i-- > lowest; )
+			{
+				if(read_le<uint32_t>(data + i) == 0x06054b50)
+				{
+					eocd = i;
+					break;
+				}
+			}
+		}
+
+		if(eocd == SIZE_MAX)
+			throw fail("no end of central directory");
+
+		uint64_t entries = read_le<uint16_t>(data + eocd + 10);
+		uint64_t cd_offset = read_le<uint32_t>(data + eocd + 16);
+
+		// large archives (numpy always allows it) use the zip64 end-of-central-directory instead.
+		if(cd_offset == 0xFFFFFFFF || entries == 0xFFFF)
+		{
+			if(eocd < 20 || read_le<uint32_t>(data + eocd - 20) != 0x07064b50)
+				throw fail("missing zip64 locator");
+
+			uint64_t z64 = read_le<uint64_t>(data + eocd - 20 + 8);
+			if(z64 + 56 > size || read_le<uint32_t>(data + z64) != 0x06064b50)
+				throw fail("bad zip64 record");
+
+			entries = read_le<uint64_t>(data + z64 + 32);
+			cd_offset = read_le<uint64_t>(data + z64 + 48);
+		}
+
+		std::map<std::string, NpyArray> ret;
+
+		size_t p = cd_offset;
+		for(uint64_t e = 0; e < entries; e++)
+		{
+			if(p + 46 > size || read_le<uint32_t>(data + p) != 0x02014b50)
+				throw fail("bad central directory");
+
+			uint16_t method     = read_le<uint16_t>(data + p + 10);
+			uint64_t csize      = read_le<uint32_t>(data + p + 20);
+			uint64_t usize      = read_le<uint32_t>(data + p + 24);
+			uint16_t name_len   = read_le<uint16_t>(data + p + 28);
+			uint16_t extra_len  = read_le<uint16_t>(data + p + 30);
+			uint16_t comment_len = read_le<uint16_t>(data + p + 32);
+			uint64_t local      = read_le<uint32_t>(data + p + 42);
+
+			auto name = std::string(reinterpret_cast<const char*>(data + p + 46), name_len);
+
+			// the zip64 extra field has the real values of whichever of these overflowed, in this order.
+			for(size_t x = p + 46 + name_len; x + 4 <= p + 46 + name_len + extra_len; )
+			{
+				uint16_t id = read_le<uint16_t>(data + x);
+				uint16_t len = read_le<uint16_t>(data + x + 2);
+				if(id == 0x0001)
+				{
+					size_t f = x + 4;
+					if(usize == 0xFFFFFFFF) { usize = read_le<uint64_t>(data + f); f += 8; }
+					if(csize == 0xFFFFFFFF) { csize = read_le<uint64_t>(data + f); f += 8; }
+					if(local == 0xFFFFFFFF) { local = read_le<uint64_t>(data + f); f += 8; }
+				}
+
+				x += 4 + len;
+			}
+
+			if(method != 0)
+				throw fail(zpr::sprint("member '%s' is compressed; save it with np.savez", name));
+
+			if(local + 30 > size || read_le<uint32_t>(data + local) != 0x04034b50)
+				throw fail("bad local header");
+
+			size_t start = local + 30 + read_le<uint16_t>(data + local + 26) + read_le<uint16_t>(data + local + 28);
+			if(start + usize > size)
+				throw fail("truncated member");
+
+			if(name.size() > 4 && name.compare(name.size() - 4, 4, ".npy") == 0)
+				name.resize(name.size() - 4);
+
+			auto arr = impl::parse_npy(data + start, usize, path + ":" + name);
+			arr.file = file;
+			ret.emplace(name, std::move(arr));
+
+			p += 46 + name_len + extra_len + comment_len;
+		}
+
+		return ret;
+	}
+
+	// inputs and targets from two .npy files, eg. saved with np.save("x.npy", x).
+	inline Dataset loadNpy(const std::string& inputs, const std::string& targets)
+	{
+		return impl::make_dataset(mapNpy(inputs), mapNpy(targets));
+	}
+
+	// inputs and targets from two members of an .npz, eg. saved with np.savez("data.npz", x=x, y=y).
+	inline Dataset loadNpz(const std::string& path, const std::string& inputs = "x", const std::string& targets = "y")
+	{
+		auto members = mapNpz(path);
+
+		auto x = members.find(inputs);
+		auto y = members.find(targets);
+		if(x == members.end() || y == members.end())
+			throw std::runtime_error(zpr::sprint("'%s': no members named '%s' and '%s'", path, inputs, targets));
+
+		return impl::make_dataset(x->second, y->second);
+	}
+
+	/*
+		our own format, which is just a Dataset dumped to disk: a header, then the inputs and then the
+		targets, each packed exactly as in memory. both blocks start on a 4k boundary, so when the file
+		is mapped back with loadDataset they're page- (and so simd-) aligned, and so is every row whose
+		size is a multiple of the simd width. the scalar type is part of the header, so a file written
+		with doubles can't be mapped as floats by accident.
+
+		the header is 64-bit little-endian words: magic, version, sizeof(scalar_t), sample count, the
+		number of input dims, then the input dims, then the same for the targets.
+	*/
+	namespace impl
+	{
+		constexpr uint64_t ZNN_MAGIC = 0x41544144'4e4e5aull;     // "ZNNDATA"
+		constexpr uint64_t ZNN_VERSION = 1;
+		constexpr size_t ZNN_BLOCK_ALIGN = 4096;
+		constexpr size_t ZNN_MAX_DIMS = 32;
+
+		inline size_t align_up(size_t x) { return (x + ZNN_BLOCK_ALIGN - 1) & ~(ZNN_BLOCK_ALIGN - 1); }
+	}
+
+	inline void saveDataset(const Dataset& data, const std::string& path)
+	{
+		std::vector<uint64_t> header = { impl::ZNN_MAGIC, impl::ZNN_VERSION, sizeof(scalar_t), data.size() };
+
+		header.push_back(data.inputShape().size());
+		header.insert(header.end(), data.inputShape().begin(), data.inputShape().end());
+		header.push_back(data.targetShape().size());
+		header.insert(header.end(), data.targetShape().begin(), data.targetShape().end());
+
+		auto f = fopen(path.c_str(), "wb");
+		if(!f)
+			throw std::runtime_error(zpr::sprint("could not open '%s' for writing", path));
+
+		size_t offset = 0;
+		auto write = [&](const void* p, size_t n) {
+			if(n > 0 && fwrite(p, 1, n, f) != n)
+			{
+				fclose(f);
+				throw std::runtime_error(zpr::sprint("could not write to '%s'", path));
+			}
+
+			offset += n;
+		};
+
+		auto pad = [&]() {
+			auto zeros = std::vector<uint8_t>(impl::align_up(offset) - offset, 0);
+			write(zeros.data(), zeros.size());
+		};
+
+		// (this assumes a little-endian host, as does everything else here.)
+		write(header.data(), header.size() * sizeof(uint64_t));
+		pad();
+
+		if(!data.empty())
+		{
+			write(data.input(0), data.size() * data.inputSize() * sizeof(scalar_t));
+			pad();
+			write(data.target(0), data.size() * data.targetSize() * sizeof(scalar_t));
+		}
+
+		fclose(f);
+	}
+
+	inline Dataset loadDataset(const std::string& path)
+	{
+		auto file = MappedFile::open(path);
+		auto data = file->data();
+		auto size = file->size();
+
+		auto fail = [&](const char* why) {
+			return std::runtime_error(zpr::sprint("'%s': invalid dataset (%s)", path, why));
+		};
+
+		size_t pos = 0;
+		auto next = [&]() -> uint64_t {
+			if(pos + 8 > size)
+				throw fail("truncated header");
+
+			auto ret = impl::read_le<uint64_t>(data + pos);
+			pos += 8;
+			return ret;
+		};
+
+		if(next() != impl::ZNN_MAGIC)       throw fail("bad magic");
+		if(next() != impl::ZNN_VERSION)     throw fail("unsupported version");
+		if(next() != sizeof(scalar_t))      throw fail("it was saved with a different scalar type");
+
+		size_t count = next();
+		auto read_shape = [&]() {
+			// (more dims than any real shape has means the header is corrupt.)
+			size_t dims = next();
+			if(dims > impl::ZNN_MAX_DIMS)
+				throw fail("too many dims");
+
+			auto ret = std::vector<size_t>(dims);
+			for(auto& x : ret)
+				x = next();
+
+			return ret;
+		};
+
+		auto input_shape = read_shape();
+		auto target_shape = read_shape();
+
+		size_t inputs = impl::align_up(pos);
+		size_t targets = inputs;
+		if(count > 0)
+		{
+			// check each step against the size of the file, so none of the sums can overflow either.
+			auto input_bytes = impl::byte_size(count, input_shape, sizeof(scalar_t));
+			auto target_bytes = impl::byte_size(count, target_shape, sizeof(scalar_t));
+
+			if(!input_bytes || !target_bytes || inputs > size || *input_bytes > size - inputs)
+				throw fail("truncated data");
+
+			targets = impl::align_up(inputs + *input_bytes);
+			if(targets > size || *target_bytes > size - targets)
+				throw fail("truncated data");
+		}
+
+		return Dataset(std::move(input_shape), std::move(target_shape), count,
+			reinterpret_cast<const scalar_t*>(data + inputs), reinterpret_cast<const scalar_t*>(data + targets),
+			std::move(file));
+	}
+}
@@ -11,3 +11,4 @@
 #include "layers/flatten.h"
 #include "layers/dropout.h"
 #include "layers/batchnorm.h"
+#include "layers/merge.h"
@@ -11,42 +11,341 @@ namespace znn
 	struct Layer;
 	namespace optimisers
 	{
+		// a contiguous run of parameters that share a regulariser (eg. the weights of one layer), as
+		// handed to the optimiser. the k-th scalar of optimiser state for values[i] is state[k * stride + i].
+		struct ParamBlock
+		{
+			scalar_t* values;
+			scalar_t* grads;
+			scalar_t* state;
+			size_t stride;
+			size_t count;
+
+			scalar_t l1;
+			scalar_t l2;
+		};
+
 		struct Optimiser
 		{
 			virtual ~Optimiser() { }
-			virtual void computeDeltas(Layer* layer, xarr& dw, xarr& db) = 0;
+
+			// how many scalars of state the optimiser keeps for each parameter (eg. 2 for adam's moments).
+			// Model owns the state, and hands it back (zeroed the first time) in update.
+			virtual size_t stateSize() = 0;
+
+			// does a whole step for one block in a single pass over it: reads the gradients, updates the
+			// state, and writes w -= scale * (delta + l1 * sign(w) + l2 * w). the gradients are consumed,
+			// ie. they're zero afterwards. most optimisers just want to call fused_update.
+			virtual void update(const ParamBlock& blk, double scale) = 0;
 		};
+
+		/*
+			the loop shared by the optimisers; delta(i, g) gets the gradients g at index i (either a simd
+			batch or a scalar, see simd::each), updates whatever state it keeps, and returns the step.
+			everything else (the regulariser, scaling, and clearing the gradient) happens here, so each
+			parameter, gradient and state value is loaded and stored exactly once.
+		*/
+		template <typename DeltaFn>
+		inline void fused_update(const ParamBlock& blk, double scale, DeltaFn&& delta)
+		{
+			auto s = scalar_t(scale);
+			auto l1 = blk.l1;
+			auto l2 = blk.l2;
+
+			auto kernel = [&](auto regularised) {
+				simd::each(blk.count, [&](size_t i, auto lanes) {
+					using V = typename decltype(lanes)::type;
+
+					V g = simd::load<V>(blk.grads + i);
+					V w = simd::load<V>(blk.values + i);
+
+					V d = delta(i, g);
+					if constexpr (decltype(regularised)::value)
+						d = d + l1 * xsimd::sign(w) + l2 * w;
+
+					simd::store<V>(blk.values + i, w - s * d);
+					simd::store<V>(blk.grads + i, V(scalar_t(0)));
+				});
+			};
+
+			// most blocks aren't regularised, so don't make them pay for it.
+			if(l1 == 0 && l2 == 0) kernel(std::false_type());
+			else                   kernel(std::true_type());
+		}
 	}
 
-	struct Layer
+	/*
+		a block of trainable parameters (eg. the weights or biases of a layer) and their gradients. it
+		starts out owning its own storage, but once the layer becomes part of a Model, the values and
+		gradients get moved into the model's arenas (see Model::bind_parameters) and this becomes a view.
+		that way, the optimiser can update every parameter in the model with one linear sweep.
+
+		l1 and l2 are the coefficients of the regulariser's derivative (l1 * sign(w) + l2 * w), which
+		gets applied together with the update.
+	*/
+	struct Parameter
 	{
-		virtual ~Layer() { }
+		Parameter(std::vector<size_t> shape, scalar_t l1 = 0, scalar_t l2 = 0) : l1(l1), l2(l2),
+			param_shape(std::move(shape))
+		{
+			this->count = std::accumulate(this->param_shape.begin(), this->param_shape.end(), (size_t) 1,
+				std::multiplies<size_t>());
 
-		virtual xarr compute(bool training, bool batched) = 0;
-		virtual void backward(const xarr& err, bool batched) = 0;
-		virtual void updateWeights(optimisers::Optimiser* opt, double scale) = 0;
+			this->storage = aligned_vector(2 * this->count, 0);
+			this->value_ptr = this->storage.data();
+			this->grad_ptr = this->storage.data() + this->count;
+		}
 
-		const xarr& getLastOutput() { return this->last_output; }
+		Parameter(const Parameter& other) : l1(other.l1), l2(other.l2), param_shape(other.param_shape),
+			count(other.count), storage(other.storage)
+		{
+			// if the other one owns its storage, we need to point at our copy; if not, we're both
+			// just views of the same arena.
+			if(other.storage.empty())
+			{
+				this->value_ptr = other.value_ptr;
+				this->grad_ptr = other.grad_ptr;
+			}
+			else
+			{
+				this->value_ptr = this->storage.data();
+				this->grad_ptr = this->storage.data() + this->count;
+			}
+		}
+
+		Parameter& operator = (const Parameter&) = delete;
+
+		size_t size() const { return this->count; }
+		const std::vector<size_t>& shape() const { return this->param_shape; }
 
-		Layer* prev() { assert(input_layer); return input_layer; }
+		scalar_t* data() { return this->value_ptr; }
+		scalar_t* grad() { return this->grad_ptr; }
+		const scalar_t* data() const { return this->value_ptr; }
+		const scalar_t* grad() const { return this->grad_ptr; }
 
-		void resetDeltas()
+		auto values() { return xt::adapt(this->value_ptr, this->count, xt::no_ownership(), this->param_shape); }
+		auto grads()  { return xt::adapt(this->grad_ptr, this->count, xt::no_ownership(), this->param_shape); }
+
+		// moves the values and gradients into the given storage (which must have space for size() scalars
+		// each), and drops our own copy.
+		void bind(scalar_t* values, scalar_t* grads)
 		{
-			this->d_weight = xt::zeros<double>(this->d_weight.shape());
-			this->d_bias = xt::zeros<double>(this->d_bias.shape());
+			std::copy(this->value_ptr, this->value_ptr + this->count, values);
+			std::copy(this->grad_ptr, this->grad_ptr + this->count, grads);
+
+			this->value_ptr = values;
+			this->grad_ptr = grads;
+
+			this->storage = aligned_vector();
+		}
 
-			if(this->input_layer != nullptr)
-				this->input_layer->resetDeltas();
+		// points the gradients at other storage (again with space for size() scalars), but leaves the
+		// values where they are. this is for Model::replicate, where the replicas share the values of
+		// the original model's parameters, but each accumulates its own gradients.
+		void bind_grads(scalar_t* grads)
+		{
+			assert(this->storage.empty());
+			this->grad_ptr = grads;
 		}
 
+		const scalar_t l1 = 0;
+		const scalar_t l2 = 0;
+
+	private:
+		std::vector<size_t> param_shape;
+		size_t count = 0;
+
+		aligned_vector storage;
+		scalar_t* value_ptr = nullptr;
+		scalar_t* grad_ptr = nullptr;
+	};
+
+	struct InferenceLayer;
+
+	/*
+		what a layer does when it's predicting, as far as Model::optimiseForInference is concerned, which
+		uses this to fold layers together. most layers are opaque, and just get left alone.
+
+		identity:  the output is the input (eg. Dropout).
+		dense:     y = act(x . W^T + b) along the last axis, where W is (outputs x inputs). `make` gives a
+		           layer that does the same thing (with the same activation), but with other weights.
+		affine:    y = x * scale + shift, with a scale and a shift for every value along the last axis.
+	*/
+	struct Fusable
+	{
+		enum class Kind { Opaque, Identity, Dense, Affine };
+		Kind kind = Kind::Opaque;
+
+		size_t inputs = 0;
+		size_t outputs = 0;
+		const scalar_t* weights = nullptr;
+		const scalar_t* biases = nullptr;
+
+		// whether the activation is Linear, ie. whether the output can be scaled after the fact.
+		bool linear = false;
+		std::function<std::unique_ptr<InferenceLayer> (xarr weights, xarr biases)> make;
+
+		std::vector<scalar_t> scale;
+		std::vector<scalar_t> shift;
+	};
+
+	/*
+		the part of a layer that predicts, which is all that a Session needs. every Layer is one of these,
+		but there are also layers that can only predict (eg. the ones that Model::optimiseForInference makes
+		by folding other layers together), which don't have the rest of the interface at all.
+	*/
+	struct InferenceLayer
+	{
+		virtual ~InferenceLayer() { }
+
+		// the inference-mode forward pass of just this layer, from `input` into `output`, which already has
+		// the right shape (ie. the batch size, if batched, then outputShape()). unlike Layer::compute, this
+		// doesn't touch any of the layer's state, so any number of threads can call it at once; see Session.
+		virtual void infer(const xview& input, xview& output, bool batched) const = 0;
+
+		// the same, with an input for each of the layer's inputs (see Layer::forwardAll).
+		virtual void inferAll(const xview* const* inputs, xview& output, bool batched) const
+		{
+			this->infer(*inputs[0], output, batched);
+		}
+
+		// the shape of one output of this layer (ie. without the batch axis).
+		virtual std::vector<size_t> outputShape() const = 0;
+
+		// see Fusable; the description only stays valid while the layer (and its parameters) don't change.
+		virtual Fusable fusable() const { return { }; }
+	};
+
+	struct Layer : InferenceLayer
+	{
+		/*
+			the forward and backward passes of just this layer. forward takes the output of the previous
+			layer, and returns this one's (see getLastOutput), which belongs to the layer and stays valid
+			until the next forward pass -- so nothing gets copied on the way from one layer to the next.
+			the input layer doesn't have a previous layer, so it just gets its own output (what it was fed).
+
+			backprop takes the same input, and the error of this layer's output; it accumulates the
+			gradients of the parameters, and returns the error of the input (which also belongs to the
+			layer). neither of them recurses; Model runs them over its layers in order (see Model::forward).
+		*/
+		virtual const xarr& forward(const xarr& input, bool training, bool batched) = 0;
+		virtual const xarr& backprop(const xarr& input, const xarr& error, bool batched) = 0;
+
+		/*
+			the same as forward, backprop and infer, but for any number of inputs (one for each of inputs()),
+			which is what Model uses. layers that take more than one input (eg. Add, Concat) override these;
+			for everything else, they just pass the one input on. backpropAll puts the error of each input
+			in errors[i] (which has a slot for each input). (inferAll is part of InferenceLayer.)
+		*/
+		virtual const xarr& forwardAll(const xarr* const* inputs, bool training, bool batched)
+		{
+			return this->forward(*inputs[0], training, batched);
+		}
+
+		virtual void backpropAll(const xarr* const* inputs, const xarr& error, const xarr** errors, bool batched)
+		{
+			errors[0] = &this->backprop(*inputs[0], error, batched);
+		}
+
+		/*
+			for checkpointing (see Checkpointing): recompute runs the training forward pass again, on the
+			same inputs as the last one, and has to give exactly the same output -- without changing any
+			other state (eg. BatchNorm's moving averages, or Dropout's mask). releaseOutput frees the
+			output until then. for layers whose forward pass has no other state, it's the same thing.
+		*/
+		virtual const xarr& recompute(const xarr* const* inputs, bool batched)
+		{
+			return this->forwardAll(inputs, /* training: */ true, batched);
+		}
+
+		void releaseOutput() { this->last_output = xarr::from_shape({ 0 }); }
+
+		/*
+			also for checkpointing, where Model frees the buffers that only the backward pass needs as soon as
+			it's done with them. releaseScratch frees whatever the layer only keeps for its own backprop (eg.
+			Dense's gradient), right after that has run. releaseErrors frees the errors that backprop returned,
+			once the layers that they went to have run backward too. backprop just allocates them again.
+		*/
+		virtual void releaseScratch() { }
+		virtual void releaseErrors() { this->input_error = xarr::from_shape({ 0 }); }
+
+		// the buffers that the layer has for backprop, besides its output, for Model::memoryPlan: the scalars
+		// (per sample) that it keeps from the forward pass (eg. Dropout's mask), the ones that backprop only
+		// uses while it runs (eg. Dense's gradient), and whether it returns errors of its own, one for each
+		// input (which Add doesn't, since it just passes on the one it gets).
+		struct BackwardBuffers
+		{
+			size_t kept = 0;
+			size_t scratch = 0;
+			bool errors = true;
+		};
+
+		virtual BackwardBuffers backwardBuffers() const { return { }; }
+
+		// runs the forward pass of every layer up to (and including) this one, by recursing through prev().
+		// this only works for a chain of layers (so not for Add or Concat); Model::forward does the same
+		// thing for any graph of layers, in a flat loop.
+		const xarr& compute(bool training, bool batched)
+		{
+			if(this->input_layers.empty())
+				return this->forward(this->last_output, training, batched);
+
+			return this->forward(this->prev()->compute(training, batched), training, batched);
+		}
+
+		// the same, but backwards, from this layer back to the first one; see Model::backward.
+		void backward(const xarr& error, bool batched)
+		{
+			if(this->input_layers.empty())
+				return;
+
+			auto& input_error = this->backprop(this->prev()->getLastOutput(), error, batched);
+			this->prev()->backward(input_error, batched);
+		}
+
+		// the trainable parameters of this layer, if any. Model collects these into its arenas.
+		virtual std::vector<Parameter*> parameters() { return { }; }
+
+		// whether training this layer on a batch that's been split into shards (each on its own replica of
+		// the model; see Model::replicate) isn't the same as training it on the whole batch, eg. BatchNorm,
+		// which normalises with the statistics of the batch (and keeps moving averages of them).
+		virtual bool needsWholeBatch() const { return false; }
+
+		const xarr& getLastOutput() { return this->last_output; }
+
+		// the layers that this one takes its inputs from, in order; this is empty for input layers, and
+		// has more than one layer for eg. Add and Concat.
+		const std::vector<Layer*>& inputs() const { return this->input_layers; }
+
+		// the one layer that this one takes its input from.
+		Layer* prev() { assert(this->input_layers.size() == 1); return this->input_layers[0]; }
+
+		// a copy of this layer that takes its inputs from `inputs` instead. since the copy of a bound
+		// Parameter is just another view of it, the clone shares the parameters (but nothing else)
+		// with this layer. this is used by Model::replicate.
+		virtual std::unique_ptr<Layer> clone(const std::vector<Layer*>& inputs) = 0;
+
 	protected:
-		Layer(Layer* in) : input_layer(in) { }
+		Layer(Layer* in) : input_layers(in ? std::vector<Layer*> { in } : std::vector<Layer*>()) { }
+		Layer(std::vector<Layer*> ins) : input_layers(std::move(ins)) { }
+
 		xarr last_output = { };
-		xarr d_weight = { };
-		xarr d_bias = { };
 
-		template <typename InputShape>
-		bool ensure_correct_dimensions(const xarr& input, bool batched)
+		// the error of the input, returned by backprop; it's kept around so it doesn't get reallocated.
+		xarr input_error = { };
+
+		// the usual implementation of clone, for layers that can just be copy-constructed.
+		template <typename T>
+		static std::unique_ptr<Layer> clone_layer(const T& self, const std::vector<Layer*>& inputs)
+		{
+			auto ret = std::make_unique<T>(self);
+			static_cast<Layer*>(ret.get())->input_layers = inputs;
+
+			return ret;
+		}
+
+		template <typename InputShape, typename Tensor>
+		bool ensure_correct_dimensions(const Tensor& input, bool batched) const
 		{
 			if(batched)
 			{
@@ -60,7 +359,7 @@ namespace znn
 			}
 		}
 
-		auto unbatched_input_shape(const xarr& input, bool batched)
+		auto unbatched_input_shape(const xarr& input, bool batched) const
 		{
 			auto shape = input.shape();
 			using shape_t = decltype(shape);
@@ -69,6 +368,6 @@ namespace znn
 		}
 
 	private:
-		Layer* input_layer = 0;
+		std::vector<Layer*> input_layers;
 	};
 }
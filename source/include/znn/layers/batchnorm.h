@@ -33,8 +33,12 @@ namespace znn::layers
 		struct BatchNorm : Layer
 		{
 			BatchNorm(InputLayer& input, double momentum, double epsilon, ActivationFn af)
-				: Layer(&input), momentum(momentum), epsilon(epsilon), activator(std::move(af))
+				: Layer(&input), momentum(momentum), epsilon(epsilon), activator(std::move(af)),
+				gamma({ ParamSize }), beta({ ParamSize })
 			{
+				// gamma starts off as 1 (and beta as 0), so the layer starts as a pure normalisation.
+				std::fill(this->gamma.data(), this->gamma.data() + ParamSize, scalar_t(1));
+
 				assert(epsilon > 0);
 				assert(0 < momentum && momentum <= 1);
 
@@ -56,62 +60,116 @@ namespace znn::layers
 
 			static_assert(InputShape::dims > 0, "input shape cannot be 0-dimensional");
 
+			// with channels, gamma and beta are per-channel; otherwise they're just scalars.
+			static constexpr size_t ParamSize = (Channelled ? InputShape::sizes[0] : 1);
 
-			virtual xarr compute(bool training, bool batched) override
+			virtual std::vector<Parameter*> parameters() override
+			{
+				return { &this->gamma, &this->beta };
+			}
+
+
+			virtual std::vector<size_t> outputShape() const override { return OutputShape::vector(); }
+
+			virtual std::unique_ptr<Layer> clone(const std::vector<Layer*>& inputs) override
+			{
+				return clone_layer(*this, inputs);
+			}
+
+			virtual const xarr& forward(const xarr& input, bool training, bool batched) override
 			{
-				auto input = this->prev()->compute(training, batched);
 				assert(ensure_correct_dimensions<InputShape>(input, batched));
 
-				xarr* mu = nullptr;
-				xarr* sigma = nullptr;
+				if(!training)
+				{
+					this->normalise(input, this->last_output);
+					return this->last_output;
+				}
 
-				if(training)
+				if(batched)
 				{
-					if(batched)
-					{
-						// std::cout << xt::adapt(xt::mean(input, axes).shape()) << "\n";
+					// std::cout << xt::adapt(xt::mean(input, axes).shape()) << "\n";
 
-						this->mean   = xt::mean(input, this->batchedAxes);
-						this->variance = xt::variance(input, this->batchedAxes);
+					this->mean   = xt::mean(input, this->batchedAxes);
+					this->variance = xt::variance(input, this->batchedAxes);
+				}
+				else
+				{
+					if constexpr (Channelled)
+					{
+						this->mean   = xt::mean(input, this->axes);
+						this->variance = xt::variance(input, this->axes);
 					}
 					else
 					{
-						if constexpr (Channelled)
-						{
-							this->mean   = xt::mean(input, this->axes);
-							this->variance = xt::variance(input, this->axes);
-						}
-						else
-						{
-							this->mean   = { xt::mean(input) };
-							this->variance = { xt::variance(input) };
-						}
+						this->mean   = { xt::mean(input) };
+						this->variance = { xt::variance(input) };
 					}
+				}
 
-					this->movingMean = (this->momentum * this->mean) + (1 - this->momentum) * this->movingMean;
-					this->movingVariance = (this->momentum * this->variance) + (1 - this->momentum) * this->movingVariance;
+				auto mom = scalar_t(this->momentum);
+				this->movingMean = (mom * this->mean) + (scalar_t(1) - mom) * this->movingMean;
+				this->movingVariance = (mom * this->variance) + (scalar_t(1) - mom) * this->movingVariance;
 
-					mu = &this->mean;
-					sigma = &this->variance;
-				}
-				else
+				return this->normalise_batch(input);
+			}
+
+			// the same normalisation, with the batch statistics from the last forward pass (which we still
+			// have, since backprop needs them too); the moving averages have already been updated.
+			virtual const xarr& recompute(const xarr* const* inputs, bool batched) override
+			{
+				auto& input = *inputs[0];
+				assert(ensure_correct_dimensions<InputShape>(input, batched));
+
+				return this->normalise_batch(input);
+			}
+
+			virtual void infer(const xview& input, xview& output, bool batched) const override
+			{
+				(void) batched;
+				assert(ensure_correct_dimensions<InputShape>(input, batched));
+				assert(ensure_correct_dimensions<OutputShape>(output, batched));
+
+				this->normalise(input, output);
+			}
+
+			// the batch statistics (and so the moving averages) need to see all of the batch at once.
+			virtual bool needsWholeBatch() const override { return true; }
+
+			// infer is just (x - mean) / stddev, which can be folded into a Dense next to us; with channels,
+			// that only works when the channels are the last axis (ie. the input is 1-d).
+			virtual Fusable fusable() const override
+			{
+				constexpr size_t Width = InputShape::template last<>;
+				if(Channelled && InputShape::dims > 1)
+					return { };
+
+				size_t n = this->movingMean.size();
+				if(n != this->movingVariance.size() || (n != 1 && n != Width))
+					return { };
+
+				auto ret = Fusable();
+				ret.kind = Fusable::Kind::Affine;
+				ret.inputs = Width;
+				ret.outputs = Width;
+
+				for(size_t i = 0; i < Width; i++)
 				{
-					mu = &this->movingMean;
-					sigma = &this->movingVariance;
-				}
+					auto k = (n == 1 ? 0 : i);
+					auto scale = scalar_t(1) / std::sqrt(this->movingVariance.data()[k] + scalar_t(this->epsilon));
 
-				auto&& output = /*this->beta + this->gamma * */((input - *mu) / xt::sqrt(*sigma + this->epsilon));
+					ret.scale.push_back(scale);
+					ret.shift.push_back(-this->movingMean.data()[k] * scale);
+				}
 
-				this->last_output = std::move(output);
-				return this->last_output;
+				return ret;
 			}
 
-			virtual void backward(const xarr& error, bool batched) override
+			virtual const xarr& backprop(const xarr& input, const xarr& error, bool batched) override
 			{
 				assert(ensure_correct_dimensions<OutputShape>(error, batched));
-				auto&& input = this->prev()->getLastOutput();
 
-				auto&& stddev_inv = (1.0 / xt::sqrt(this->variance + this->epsilon));
+				auto&& stddev_inv = (scalar_t(1) / xt::sqrt(this->variance + scalar_t(this->epsilon)));
 
 				/*
 					∂L/∂x̂  = ∂L/∂y * γ
@@ -123,12 +181,12 @@ namespace znn::layers
 					∂L/∂β  = Σ[∂L/∂y]
 				*/
 
-				double batch_size = (batched ? error.shape()[0] : 1);
+				scalar_t batch_size = (batched ? error.shape()[0] : 1);
 
 				auto& axis = batched ? this->batchedAxes : this->axes;
 				auto&& diff = input - this->mean;
 
-				auto&& d_norm = error * this->gamma;
+				auto&& d_norm = error * this->gamma.values();
 
 				// auto&& d_var  = xt::sum(d_norm * diff, axis) * -0.5 * xt::pow(stddev_inv, 3);
 				// auto&& d_x    = (d_norm * stddev_inv) + (diff * (d_var * 2 / batch_size))
@@ -148,18 +206,11 @@ namespace znn::layers
 				auto&& d_gamm = xt::sum(error * this->last_output, axis);
 				auto&& d_beta = xt::sum(error, axis);
 
-				this->d_weight += d_gamm;
-				this->d_bias   += d_beta;
+				this->gamma.grads() += d_gamm;
+				this->beta.grads()  += d_beta;
 
-				this->prev()->backward(d_x, batched);
-			}
-
-			virtual void updateWeights(optimisers::Optimiser* opt, double scale) override
-			{
-				this->gamma -= scale * this->d_weight;
-				this->beta  -= scale * this->d_bias;
-
-				this->prev()->updateWeights(opt, scale);
+				xt::noalias(this->input_error) = d_x;
+				return this->input_error;
 			}
 
 		private:
@@ -167,8 +218,8 @@ namespace znn::layers
 			const double epsilon = 0;
 			ActivationFn activator;
 
-			xarr gamma = { 1 };
-			xarr beta = { 0 };
+			Parameter gamma;
+			Parameter beta;
 
 			// this is the per-batch stuff
 			xarr mean;
@@ -181,6 +232,23 @@ namespace znn::layers
 
 			std::vector<size_t> axes;
 			std::vector<size_t> batchedAxes;
+
+			// with the statistics of the current batch, into last_output.
+			const xarr& normalise_batch(const xarr& input)
+			{
+				xt::noalias(this->last_output) = /*this->beta + this->gamma * */((input - this->mean)
+					/ xt::sqrt(this->variance + scalar_t(this->epsilon)));
+
+				return this->last_output;
+			}
+
+			// when predicting, we normalise with the moving mean and variance instead.
+			template <typename In, typename Out>
+			void normalise(const In& input, Out& output) const
+			{
+				xt::noalias(output) = /*this->beta + this->gamma * */((input - this->movingMean)
+					/ xt::sqrt(this->movingVariance + scalar_t(this->epsilon)));
+			}
 		};
 	}
 
@@ -13,6 +13,42 @@ namespace znn::layers
 {
 	namespace impl
 	{
+		/*
+			the forward pass of a dense layer, with `n` outputs and `width` inputs, on `rows` rows of input: the
+			leading axes of the input are collapsed into rows, so the output is X . W^T, where the transpose is
+			just a flag to gemm -- we only keep the one (N x I) copy of the weights.
+
+			the gemm is done in tiles of rows that fit in L2, and for each tile we add the bias and apply the
+			activation right after, while it's still in cache -- instead of making a separate pass over the
+			whole output for each step.
+		*/
+		template <typename ActivationFn>
+		void dense_infer(const scalar_t* input, size_t rows, scalar_t* out, size_t n, size_t width,
+			const scalar_t* weights, const scalar_t* biases, const ActivationFn& activator)
+		{
+			const size_t TILE_BYTES = 256 * 1024;
+			const size_t TILE_ROWS = std::max((size_t) 1, TILE_BYTES / (n * sizeof(scalar_t)));
+
+			for(size_t tile = 0; tile < rows; tile += TILE_ROWS)
+			{
+				size_t count = std::min(TILE_ROWS, rows - tile);
+				util::gemm<scalar_t>(/* transA: */ false, /* transB: */ true, count, n, width,
+					scalar_t(1), input + (tile * width), weights, scalar_t(0), out + (tile * n));
+
+				for(size_t r = tile; r < tile + count; r++)
+				{
+					auto row = out + (r * n);
+					for(size_t j = 0; j < n; j++)
+						row[j] += biases[j];
+
+					activator.forward_inplace(row, n);
+				}
+			}
+		}
+
+		template <typename ActivationFn>
+		struct FusedDense;
+
 		// the dense layer only operates on the last dimension of the input tensor, leaving the
 		// other dimensions intact. eg. if the input is 500x300x100, passing it through a Dense
 		// would yield an output of 500x300xN
@@ -20,125 +56,194 @@ namespace znn::layers
 		struct Dense : Layer
 		{
 			Dense(InputLayer& input, ActivationFn af, RegulariserFn rf) : Layer(&input),
-				activator(std::move(af)), regulariser(std::move(rf))
+				activator(std::move(af)), regulariser(std::move(rf)),
+				weights({ N, InputWidth }, this->regulariser.l1(), this->regulariser.l2()), biases({ N })
 			{
 				// fill with normally-distributed junk
-				this->weights = xt::random::randn<double>(this->weights.shape(), 0, 1);
-				this->transposedWeights = xt::transpose(this->weights);
+				this->weights.values() = xt::random::randn<scalar_t>(this->weights.shape(), 0, 1);
 			}
 
 			using InputShape = typename InputLayer::OutputShape;
 			using OutputShape = typename InputShape::template drop<1>::template add<N>;
 			static_assert(InputShape::dims > 0, "input shape cannot be 0-dimensional");
 
-			virtual xarr compute(bool training, bool batched) override
+			static constexpr size_t InputWidth = InputShape::template last<>;
+
+			virtual std::vector<Parameter*> parameters() override
 			{
-				auto input = this->prev()->compute(training, batched);
+				return { &this->weights, &this->biases };
+			}
+
+			virtual std::vector<size_t> outputShape() const override { return OutputShape::vector(); }
+
+			virtual std::unique_ptr<Layer> clone(const std::vector<Layer*>& inputs) override
+			{
+				return clone_layer(*this, inputs);
+			}
+
+			virtual const xarr& forward(const xarr& input, bool training, bool batched) override
+			{
+				(void) training;
 				assert(ensure_correct_dimensions<InputShape>(input, batched));
 
-				// util::matrix_mul(input, this->transposedWeights) + this->biases;
-				xarr output = xt::linalg::tensordot(input, this->transposedWeights, 1) + this->biases;
+				// the gemm writes straight into the output, which only reallocates if the shape changed.
+				auto out_shape = input.shape();
+				out_shape.back() = N;
+				this->last_output.resize(out_shape);
 
-				assert(ensure_correct_dimensions<OutputShape>(output, batched));
+				dense_infer(input.data(), input.size() / InputWidth, this->last_output.data(), N, InputWidth,
+					this->weights.data(), this->biases.data(), this->activator);
 
-				this->last_output = xt::eval(this->activator.forward(output));
 				return this->last_output;
 			}
 
-			virtual void backward(const xarr& error, bool batched) override
+			virtual void infer(const xview& input, xview& output, bool batched) const override
+			{
+				assert(ensure_correct_dimensions<InputShape>(input, batched));
+				assert(ensure_correct_dimensions<OutputShape>(output, batched));
+
+				dense_infer(input.data(), input.size() / InputWidth, output.data(), N, InputWidth,
+					this->weights.data(), this->biases.data(), this->activator);
+			}
+
+			virtual Fusable fusable() const override
+			{
+				auto ret = Fusable();
+				ret.kind = Fusable::Kind::Dense;
+				ret.inputs = InputWidth;
+				ret.outputs = N;
+				ret.weights = this->weights.data();
+				ret.biases = this->biases.data();
+				ret.linear = std::is_same_v<ActivationFn, activations::Linear>;
+
+				ret.make = [af = this->activator](xarr weights, xarr biases) -> std::unique_ptr<InferenceLayer> {
+					return std::make_unique<FusedDense<ActivationFn>>(OutputShape::vector(), std::move(weights),
+						std::move(biases), af);
+				};
+
+				return ret;
+			}
+
+			virtual const xarr& backprop(const xarr& input, const xarr& error, bool batched) override
 			{
 				assert(ensure_correct_dimensions<OutputShape>(error, batched));
 
-				auto gradient = error * this->activator.derivative(this->last_output);
-				auto newerror = backward_weight_mul(this->transposedWeights, gradient, batched);
+				// gradient = error * f'(output), in one pass; the buffer is kept around between calls.
+				auto& gradient = this->gradient;
+				gradient.resize(error.shape());
+				this->activator.backward(this->last_output.data(), error.data(), gradient.data(), error.size());
 
-				auto&& input = this->prev()->getLastOutput();
-				if(batched)
-				{
-					assert(gradient.shape()[0] == input.shape()[0]);
+				assert(input.size() / InputWidth == gradient.size() / N);
 
-					size_t batch_size = gradient.shape()[0];
-					xarr dw = xt::zeros<double>(weights.shape());
+				// since we only operate on the last axis, every other axis (including the batch axis)
+				// can be collapsed into the rows of a matrix. then, G is (rows x N) and X is (rows x I),
+				// and the weight gradient is just G^T . X -- which we accumulate directly into the gradient.
+				size_t rows = gradient.size() / N;
+				util::gemm<scalar_t>(/* transA: */ true, /* transB: */ false, N, InputWidth, rows,
+					scalar_t(1), gradient.data(), input.data(), scalar_t(1), this->weights.grad());
 
-					for(size_t i = 0; i < batch_size; i++)
-					{
-						auto&& gd = xt::view(gradient, i);
-						auto&& in = xt::view(input, i);
+				// the error to propagate is G . W, which is (rows x I).
+				auto err_shape = gradient.shape();
+				err_shape.back() = InputWidth;
 
-						dw += util::matrix_mul(gd, xt::transpose(in));
-					}
+				this->input_error.resize(err_shape);
+				util::gemm<scalar_t>(/* transA: */ false, /* transB: */ false, rows, InputWidth, N,
+					scalar_t(1), gradient.data(), this->weights.data(), scalar_t(0), this->input_error.data());
 
-					this->d_weight += dw;
-					this->d_bias += xt::sum(gradient, 0);
-				}
-				else
+				// each bias contributes to every row of the output, so its gradient is the sum over all
+				// the rows (whether they come from the batch axis or the input's own leading axes).
+				auto d_bias = this->biases.grad();
+				for(size_t r = 0; r < rows; r++)
 				{
-					this->d_weight += util::matrix_mul(gradient, xt::transpose(input));
-					this->d_bias += gradient;
+					auto row = gradient.data() + (r * N);
+					for(size_t j = 0; j < N; j++)
+						d_bias[j] += row[j];
 				}
 
-				this->prev()->backward(newerror, batched);
+				return this->input_error;
 			}
 
-			virtual void updateWeights(optimisers::Optimiser* opt, double scale) override
-			{
-				assert(zfu::equal(this->d_weight.shape(), weights.shape()));
-				opt->computeDeltas(this, this->d_weight, this->d_bias);
-
-				// also regularise the weight, which applies a penalty for large weights
-				// to combat overfitting.
-				this->weights -= scale * (this->d_weight + this->regulariser.derivative(this->weights));
-
-				// note that we need to collapse the incoming db; each bias contributes
-				// to multiple nodes' errors downstream, so we just do the simple thing and
-				// sum them up.
-				this->biases -= scale * xt::sum(this->d_bias, 0);
+			virtual void releaseScratch() override { this->gradient = xarr::from_shape({ 0 }); }
 
-				this->transposedWeights = xt::transpose(this->weights);
-				this->prev()->updateWeights(opt, scale);
+			virtual BackwardBuffers backwardBuffers() const override
+			{
+				auto ret = BackwardBuffers();
+				ret.scratch = OutputShape::flatten();
+				return ret;
 			}
 
 		private:
 			ActivationFn activator;
 			RegulariserFn regulariser;
-			xt::xtensor_fixed<double, xt::xshape<N>> biases;
-			xt::xtensor_fixed<double, xt::xshape<N, InputShape::template last<>>> weights;
-			xt::xtensor_fixed<double, xt::xshape<InputShape::template last<>, N>> transposedWeights;
 
-			template <typename At, typename Bt, typename R = std::common_type_t<typename At::value_type, typename Bt::value_type>>
-			xt::xarray<R> backward_weight_mul(const xt::xexpression<At>& aexp, const xt::xexpression<Bt>& bexp, bool batched)
+			// the regulariser only affects the weights; it's applied by the optimiser (see Parameter).
+			Parameter weights;
+			Parameter biases;
+
+			// scratch space for backward, so we don't reallocate it every time
+			xarr gradient;
+		};
+
+		/*
+			a dense layer whose sizes are only known at runtime, which Model::optimiseForInference makes by
+			folding other layers into a Dense (see Fusable). it has its own copy of the weights (since they're
+			not the same as any Dense's anymore), and it can only predict -- it's not part of any Model, just
+			the Sessions of an optimised one, so it's only an InferenceLayer (with no training interface).
+		*/
+		template <typename ActivationFn>
+		struct FusedDense : InferenceLayer
+		{
+			FusedDense(std::vector<size_t> shape, xarr weights, xarr biases, ActivationFn af)
+				: activator(std::move(af)), output_shape(std::move(shape)), weights(std::move(weights)),
+				biases(std::move(biases))
 			{
-				auto&& weight = xt::view_eval<At::static_layout>(aexp.derived_cast());
-				auto&& gradient = xt::view_eval<Bt::static_layout>(bexp.derived_cast());
+				assert(this->weights.dimension() == 2);
+				assert(this->biases.size() == this->weights.shape()[0]);
+				assert(this->output_shape.back() == this->weights.shape()[0]);
+			}
 
-				if(batched)
-				{
-					assert(weight.shape().back() == gradient.shape()[1]);
-					auto batch_size = gradient.shape()[0];
+			virtual std::vector<size_t> outputShape() const override { return this->output_shape; }
 
-					std::vector<size_t> out_shape;
-					out_shape.push_back(batch_size);
-					for(size_t i = 0; i < weight.dimension() - 1; i++)
-						out_shape.push_back(weight.shape()[i]);
+			virtual void infer(const xview& input, xview& output, bool batched) const override
+			{
+				(void) batched;
+				assert(output.size() / this->weights.shape()[0] == input.size() / this->weights.shape()[1]);
 
-					for(size_t i = 2; i < gradient.dimension(); i++)
-						out_shape.push_back(gradient.shape()[i]);
+				this->run(input.data(), input.size(), output.data());
+			}
 
-					auto result = xarr::from_shape(out_shape);
-					auto& b = gradient;
-					auto& a = weight;
+			virtual Fusable fusable() const override
+			{
+				auto ret = Fusable();
+				ret.kind = Fusable::Kind::Dense;
+				ret.inputs = this->weights.shape()[1];
+				ret.outputs = this->weights.shape()[0];
+				ret.weights = this->weights.data();
+				ret.biases = this->biases.data();
+				ret.linear = std::is_same_v<ActivationFn, activations::Linear>;
 
-					for(size_t i = 0; i < batch_size; i++)
-						xt::view(result, i) = util::matrix_mul(a, xt::view(b, i));
+				ret.make = [af = this->activator, shape = this->output_shape](xarr weights, xarr biases) -> std::unique_ptr<InferenceLayer> {
+					return std::make_unique<FusedDense<ActivationFn>>(shape, std::move(weights), std::move(biases), af);
+				};
 
-					return result;
-				}
-				else
-				{
-					assert(weight.shape().back() == gradient.shape().front());
-					return util::matrix_mul(weight, gradient);
-				}
+				return ret;
+			}
+
+		private:
+			ActivationFn activator;
+			std::vector<size_t> output_shape;
+
+			void run(const scalar_t* input, size_t count, scalar_t* out) const
+			{
+				size_t width = this->weights.shape()[1];
+				assert(count % width == 0);
+
+				dense_infer(input, count / width, out, this->weights.shape()[0], width, this->weights.data(),
+					this->biases.data(), this->activator);
 			}
+
+			xarr weights;
+			xarr biases;
 		};
 	}
 
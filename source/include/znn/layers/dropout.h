@@ -16,7 +16,8 @@ namespace znn::layers
 		template <typename InputLayer>
 		struct Dropout : Layer
 		{
-			Dropout(InputLayer& input, double probability) : Layer(&input), probability(probability)
+			Dropout(InputLayer& input, double probability) : Layer(&input), probability(probability),
+				rng(util::getSeed())
 			{
 				assert(0 <= probability && probability < 1.0);
 			}
@@ -27,64 +28,122 @@ namespace znn::layers
 			static_assert(InputShape::dims > 0, "input shape cannot be 0-dimensional");
 
 
-			virtual xarr compute(bool training, bool batched) override
+			virtual std::vector<size_t> outputShape() const override { return OutputShape::vector(); }
+
+			virtual std::unique_ptr<Layer> clone(const std::vector<Layer*>& inputs) override
+			{
+				// the clone draws its masks from its own engine, seeded from this one, so a replica
+				// doesn't drop the same units as the original (but it's still reproducible).
+				auto ret = clone_layer(*this, inputs);
+				static_cast<Dropout*>(ret.get())->rng.seed(this->rng());
+
+				return ret;
+			}
+
+			virtual const xarr& forward(const xarr& input, bool training, bool batched) override
 			{
-				auto input = this->prev()->compute(training, batched);
 				assert(ensure_correct_dimensions<InputShape>(input, batched));
 
 				if(training)
 				{
-					auto perform = [&](auto& m) -> xarr {
+					auto perform = [&](auto& m) {
 						// we need to scale it by 1/(1-P) to keep the expected sum of the output values
 						// the same regardless of the dropout probability
-						m /= (1.0 - this->probability);
-						return m * input;
+						m /= scalar_t(1.0 - this->probability);
+						xt::noalias(this->last_output) = m * input;
 					};
 
 					// first generate the mask. we lose nodes with P probability, so we want to generate
 					// a binomial distribution with 1-P chance of success.
-					auto&& rands = xt::random::binomial<double>(input.shape(), 1, 1.0 - this->probability);
+					auto&& rands = xt::random::binomial<int>(input.shape(), 1, 1.0 - this->probability, this->rng);
 					if(batched)
 					{
 						this->batchedMask = std::move(rands);
-						this->last_output = perform(this->batchedMask);
+						perform(this->batchedMask);
 					}
 					else
 					{
 						this->mask = std::move(rands);
-						this->last_output = perform(this->mask);
+						perform(this->mask);
 					}
+
+					return this->last_output;
 				}
 				else
 				{
-					this->last_output = std::move(input);
+					// there's no backward pass after an inference pass, so we don't need a copy of our own.
+					return input;
 				}
+			}
+
+			// the mask is kept for backprop anyway, so we just apply it again (it's already been scaled).
+			virtual const xarr& recompute(const xarr* const* inputs, bool batched) override
+			{
+				auto& input = *inputs[0];
+				assert(ensure_correct_dimensions<InputShape>(input, batched));
+
+				if(batched) xt::noalias(this->last_output) = this->batchedMask * input;
+				else        xt::noalias(this->last_output) = this->mask * input;
 
 				return this->last_output;
 			}
 
-			virtual void backward(const xarr& error, bool batched) override
+			// when predicting, we don't do anything at all.
+			virtual Fusable fusable() const override
 			{
+				auto ret = Fusable();
+				ret.kind = Fusable::Kind::Identity;
+
+				return ret;
+			}
+
+			// dropout only happens during training, so this is just a copy.
+			virtual void infer(const xview& input, xview& output, bool batched) const override
+			{
+				(void) batched;
+				assert(ensure_correct_dimensions<InputShape>(input, batched));
+				assert(input.size() == output.size());
+
+				std::copy(input.data(), input.data() + input.size(), output.data());
+			}
+
+			virtual const xarr& backprop(const xarr& input, const xarr& error, bool batched) override
+			{
+				(void) input;
 				assert(ensure_correct_dimensions<OutputShape>(error, batched));
 
 				// since we have no weights, there's no need to update dw or db.
-				if(batched) this->prev()->backward(this->batchedMask * error, batched);
-				else        this->prev()->backward(this->mask * error, batched);
+				if(batched) xt::noalias(this->input_error) = this->batchedMask * error;
+				else        xt::noalias(this->input_error) = this->mask * error;
+
+				return this->input_error;
+			}
+
+			// the mask is only needed until backprop (and for recompute, which comes before it).
+			virtual void releaseScratch() override
+			{
+				this->mask = decltype(this->mask)();
+				this->batchedMask = decltype(this->batchedMask)();
 			}
 
-			virtual void updateWeights(optimisers::Optimiser* opt, double scale) override
+			virtual BackwardBuffers backwardBuffers() const override
 			{
-				// just passthrough
-				this->prev()->updateWeights(opt, scale);
+				auto ret = BackwardBuffers();
+				ret.kept = InputShape::flatten();
+				return ret;
 			}
 
 		private:
 			double probability = 0;
 
+			// each layer has its own engine (instead of xtensor's global one), so that replicas of
+			// the model can train on different threads.
+			std::mt19937 rng;
+
 			// xtensor_fixed demands an xshape shape, which demands variadic template args; we can't
 			// convert our znn::shape to that, so the best we can do is fix the number of dimensions.
-			xt::xtensor<double, InputShape::dims> mask;
-			xt::xtensor<double, 1 + InputShape::dims> batchedMask;
+			xt::xtensor<scalar_t, InputShape::dims> mask;
+			xt::xtensor<scalar_t, 1 + InputShape::dims> batchedMask;
 		};
 	}
 
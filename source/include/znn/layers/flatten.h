@@ -25,49 +25,58 @@ namespace znn::layers
 
 			static_assert(InputShape::dims > 0, "input shape cannot be 0-dimensional");
 
-			virtual xarr compute(bool training, bool batched) override
-			{
-				auto input = this->prev()->compute(training, batched);
-				assert(ensure_correct_dimensions<InputShape>(input, batched));
+			virtual std::vector<size_t> outputShape() const override { return OutputShape::vector(); }
 
-				// we're only supposed to flatten each input set, so we must exclude the first
-				// axis (batch size) from flattening.
-				this->last_output = (batched
-					? xarr(xt::reshape_view(input, { input.shape()[0], OutputShape::sizes[0] }))
-					: xarr(xt::flatten(input))
-				);
-
-				return this->last_output;
+			virtual std::unique_ptr<Layer> clone(const std::vector<Layer*>& inputs) override
+			{
+				return clone_layer(*this, inputs);
 			}
 
-			virtual void backward(const xarr& error, bool batched) override
+			virtual const xarr& forward(const xarr& input, bool training, bool batched) override
 			{
-				assert(ensure_correct_dimensions<OutputShape>(error, batched));
+				(void) training;
+				assert(ensure_correct_dimensions<InputShape>(input, batched));
 
-				xarr newerror;
+				// we're only supposed to flatten each input set, so we must exclude the first axis (batch
+				// size) from flattening. the data doesn't change, only the shape. (the shapes are arrays,
+				// so there's no allocation unless the output actually needs resizing.)
+				auto& output = this->last_output;
 				if(batched)
 				{
-					std::vector<size_t> shape;
-					shape.reserve(error.shape().size() + 1);
-					shape.push_back(error.shape()[0]);
-					shape.insert(shape.end(), InputShape::sizes.begin(), InputShape::sizes.end());
-
-					newerror = xt::reshape_view(error, shape);
+					auto shape = std::array<size_t, 2> { input.shape()[0], OutputShape::sizes[0] };
+					if(!zfu::equal(output.shape(), shape))
+						output.resize(shape);
 				}
 				else
 				{
-					newerror = xt::reshape_view(error, InputShape::sizes);
+					if(!zfu::equal(output.shape(), OutputShape::sizes))
+						output.resize(OutputShape::sizes);
 				}
 
+				std::copy(input.data(), input.data() + input.size(), output.data());
+				return this->last_output;
+			}
+
+			virtual void infer(const xview& input, xview& output, bool batched) const override
+			{
+				assert(ensure_correct_dimensions<InputShape>(input, batched));
+				assert(ensure_correct_dimensions<OutputShape>(output, batched));
 
-				// there's no need to call update_dw_db here, since we have no weights nor biases
-				this->prev()->backward(newerror, batched);
+				std::copy(input.data(), input.data() + input.size(), output.data());
 			}
 
-			virtual void updateWeights(optimisers::Optimiser* opt, double scale) override
+			virtual const xarr& backprop(const xarr& input, const xarr& error, bool batched) override
 			{
-				// just passthrough
-				this->prev()->updateWeights(opt, scale);
+				assert(ensure_correct_dimensions<OutputShape>(error, batched));
+				assert(input.size() == error.size());
+
+				// the error just goes back to the input's shape. there's no need to call update_dw_db
+				// here, since we have no weights nor biases.
+				if(!zfu::equal(this->input_error.shape(), input.shape()))
+					this->input_error.resize(input.shape());
+
+				std::copy(error.data(), error.data() + error.size(), this->input_error.data());
+				return this->input_error;
 			}
 
 		private:
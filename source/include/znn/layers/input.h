@@ -29,24 +29,37 @@ namespace znn::layers
 				this->last_output = input;
 			}
 
-			virtual xarr compute(bool training, bool batched) override
+			virtual std::vector<size_t> outputShape() const override { return OutputShape::vector(); }
+
+			virtual std::unique_ptr<Layer> clone(const std::vector<Layer*>& inputs) override
+			{
+				return clone_layer(*this, inputs);
+			}
+
+			// the input is what we were fed, ie. our own output; there's nothing to do.
+			virtual const xarr& forward(const xarr& input, bool training, bool batched) override
 			{
+				(void) input;
 				(void) training;
 				assert(ensure_correct_dimensions<InputShape>(this->last_output, batched));
 
 				return this->last_output;
 			}
 
-			virtual void backward(const xarr& err, bool batched) override
+			virtual void infer(const xview& input, xview& output, bool batched) const override
 			{
-				(void) err;
 				(void) batched;
+				assert(ensure_correct_dimensions<InputShape>(input, batched));
+				assert(input.size() == output.size());
+
+				std::copy(input.data(), input.data() + input.size(), output.data());
 			}
 
-			virtual void updateWeights(optimisers::Optimiser* opt, double scale) override
+			virtual const xarr& backprop(const xarr& input, const xarr& error, bool batched) override
 			{
-				(void) opt;
-				(void) scale;
+				(void) input;
+				(void) batched;
+				return error;
 			}
 
 		private:
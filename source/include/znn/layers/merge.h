@@ -0,0 +1,278 @@
+// merge.h
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#pragma once
+
+#include "base.h"
+
+namespace znn::layers
+{
+	/*
+		layers that take more than one input, for models that aren't just a chain of layers (eg. residual
+		connections, or several towers side by side). any layer's output can also go to more than one
+		layer; Model sums up the errors that come back from each of them.
+
+		Add sums its inputs, which all need to have the same shape. Concat joins them along their last
+		axis, so all the other axes need to match.
+	*/
+	namespace impl
+	{
+		// forward, backprop and infer only take one input, which is only enough when there's only one
+		// (and then the layer is just an identity). with more, they can't do anything sensible, so they
+		// fail loudly; the layer has to be run with forwardAll and friends, like Model does.
+		template <size_t Count>
+		void ensure_single_input(const char* layer)
+		{
+			if constexpr (Count != 1)
+			{
+				throw std::logic_error(zpr::sprint("%s with %zu inputs can only be run through forwardAll, "
+					"backpropAll and inferAll (eg. by Model)", layer, Count));
+			}
+		}
+
+		template <typename... InputLayers>
+		struct Add : Layer
+		{
+			Add(InputLayers&... inputs) : Layer(std::vector<Layer*> { &inputs... })
+			{
+			}
+
+			using InputShape = typename std::tuple_element_t<0, std::tuple<InputLayers...>>::OutputShape;
+			using OutputShape = InputShape;
+
+			static_assert(InputShape::dims > 0, "input shape cannot be 0-dimensional");
+			static_assert((std::is_same_v<typename InputLayers::OutputShape, InputShape> && ...),
+				"all the inputs of Add must have the same shape");
+
+			virtual std::vector<size_t> outputShape() const override { return OutputShape::vector(); }
+
+			virtual std::unique_ptr<Layer> clone(const std::vector<Layer*>& inputs) override
+			{
+				return clone_layer(*this, inputs);
+			}
+
+			// these are only for a single input, where we're just an identity (see ensure_single_input).
+			virtual const xarr& forward(const xarr& input, bool training, bool batched) override
+			{
+				ensure_single_input<sizeof...(InputLayers)>("Add");
+
+				const xarr* ins[] = { &input };
+				return this->forwardAll(ins, training, batched);
+			}
+
+			virtual const xarr& backprop(const xarr& input, const xarr& error, bool batched) override
+			{
+				(void) input;
+				(void) batched;
+				ensure_single_input<sizeof...(InputLayers)>("Add");
+
+				return error;
+			}
+
+			virtual void infer(const xview& input, xview& output, bool batched) const override
+			{
+				ensure_single_input<sizeof...(InputLayers)>("Add");
+
+				const xview* ins[] = { &input };
+				this->inferAll(ins, output, batched);
+			}
+
+			virtual const xarr& forwardAll(const xarr* const* inputs, bool training, bool batched) override
+			{
+				(void) training;
+				assert(ensure_correct_dimensions<InputShape>(*inputs[0], batched));
+
+				if(!zfu::equal(this->last_output.shape(), inputs[0]->shape()))
+					this->last_output.resize(inputs[0]->shape());
+
+				this->sum(inputs, this->last_output.data());
+				return this->last_output;
+			}
+
+			// every input gets the whole of the error, so there's nothing to copy.
+			virtual void backpropAll(const xarr* const* inputs, const xarr& error, const xarr** errors, bool batched) override
+			{
+				(void) inputs;
+				assert(ensure_correct_dimensions<OutputShape>(error, batched));
+
+				for(size_t i = 0; i < sizeof...(InputLayers); i++)
+					errors[i] = &error;
+			}
+
+			virtual BackwardBuffers backwardBuffers() const override
+			{
+				auto ret = BackwardBuffers();
+				ret.errors = false;
+				return ret;
+			}
+
+			virtual void inferAll(const xview* const* inputs, xview& output, bool batched) const override
+			{
+				assert(ensure_correct_dimensions<InputShape>(*inputs[0], batched));
+				assert(output.size() == inputs[0]->size());
+
+				this->sum(inputs, output.data());
+			}
+
+		private:
+			template <typename Tensor>
+			static void sum(const Tensor* const* inputs, scalar_t* out)
+			{
+				auto& first = *inputs[0];
+				std::copy(first.data(), first.data() + first.size(), out);
+
+				for(size_t k = 1; k < sizeof...(InputLayers); k++)
+				{
+					assert(zfu::equal(inputs[k]->shape(), first.shape()));
+
+					auto in = inputs[k]->data();
+					simd::each(first.size(), [&](size_t i, auto lanes) {
+						using V = typename decltype(lanes)::type;
+						simd::store<V>(out + i, simd::load<V>(out + i) + simd::load<V>(in + i));
+					});
+				}
+			}
+		};
+
+		template <typename... InputLayers>
+		struct Concat : Layer
+		{
+			Concat(InputLayers&... inputs) : Layer(std::vector<Layer*> { &inputs... })
+			{
+			}
+
+			using FirstShape = typename std::tuple_element_t<0, std::tuple<InputLayers...>>::OutputShape;
+
+			static constexpr size_t Count = sizeof...(InputLayers);
+			static constexpr std::array<size_t, Count> Widths = { InputLayers::OutputShape::template last<>... };
+			static constexpr size_t Width = (InputLayers::OutputShape::template last<> + ...);
+
+			using OutputShape = typename FirstShape::template drop<1>::template add<Width>;
+
+			static_assert(FirstShape::dims > 0, "input shape cannot be 0-dimensional");
+			static_assert((std::is_same_v<typename InputLayers::OutputShape::template drop<1>,
+				typename FirstShape::template drop<1>> && ...),
+				"the inputs of Concat can only differ in their last axis");
+
+			virtual std::vector<size_t> outputShape() const override { return OutputShape::vector(); }
+
+			virtual std::unique_ptr<Layer> clone(const std::vector<Layer*>& inputs) override
+			{
+				return clone_layer(*this, inputs);
+			}
+
+			// these are only for a single input, where we're just an identity (see ensure_single_input).
+			virtual const xarr& forward(const xarr& input, bool training, bool batched) override
+			{
+				ensure_single_input<sizeof...(InputLayers)>("Concat");
+
+				const xarr* ins[] = { &input };
+				return this->forwardAll(ins, training, batched);
+			}
+
+			virtual const xarr& backprop(const xarr& input, const xarr& error, bool batched) override
+			{
+				(void) input;
+				(void) batched;
+				ensure_single_input<sizeof...(InputLayers)>("Concat");
+
+				return error;
+			}
+
+			virtual void infer(const xview& input, xview& output, bool batched) const override
+			{
+				ensure_single_input<sizeof...(InputLayers)>("Concat");
+
+				const xview* ins[] = { &input };
+				this->inferAll(ins, output, batched);
+			}
+
+			virtual const xarr& forwardAll(const xarr* const* inputs, bool training, bool batched) override
+			{
+				(void) training;
+
+				auto out_shape = inputs[0]->shape();
+				out_shape.back() = Width;
+
+				if(!zfu::equal(this->last_output.shape(), out_shape))
+					this->last_output.resize(out_shape);
+
+				assert(ensure_correct_dimensions<OutputShape>(this->last_output, batched));
+
+				this->join(inputs, this->last_output.data(), this->last_output.size() / Width);
+				return this->last_output;
+			}
+
+			// each input gets its slice of the error back.
+			virtual void backpropAll(const xarr* const* inputs, const xarr& error, const xarr** errors, bool batched) override
+			{
+				assert(ensure_correct_dimensions<OutputShape>(error, batched));
+
+				size_t rows = error.size() / Width;
+				size_t ofs = 0;
+
+				for(size_t k = 0; k < Count; k++)
+				{
+					auto& err = this->input_errors[k];
+					if(!zfu::equal(err.shape(), inputs[k]->shape()))
+						err.resize(inputs[k]->shape());
+
+					for(size_t r = 0; r < rows; r++)
+					{
+						auto src = error.data() + (r * Width) + ofs;
+						std::copy(src, src + Widths[k], err.data() + (r * Widths[k]));
+					}
+
+					errors[k] = &err;
+					ofs += Widths[k];
+				}
+			}
+
+			virtual void inferAll(const xview* const* inputs, xview& output, bool batched) const override
+			{
+				assert(ensure_correct_dimensions<OutputShape>(output, batched));
+				this->join(inputs, output.data(), output.size() / Width);
+			}
+
+			virtual void releaseErrors() override
+			{
+				for(auto& err : this->input_errors)
+					err = xarr::from_shape({ 0 });
+			}
+
+		private:
+			std::array<xarr, Count> input_errors;
+
+			template <typename Tensor>
+			static void join(const Tensor* const* inputs, scalar_t* out, size_t rows)
+			{
+				size_t ofs = 0;
+				for(size_t k = 0; k < Count; k++)
+				{
+					assert(inputs[k]->size() == rows * Widths[k]);
+
+					for(size_t r = 0; r < rows; r++)
+					{
+						auto src = inputs[k]->data() + (r * Widths[k]);
+						std::copy(src, src + Widths[k], out + (r * Width) + ofs);
+					}
+
+					ofs += Widths[k];
+				}
+			}
+		};
+	}
+
+	template <typename... InputLayers>
+	impl::Add<InputLayers...> Add(InputLayers&... inputs)
+	{
+		return impl::Add<InputLayers...>(inputs...);
+	}
+
+	template <typename... InputLayers>
+	impl::Concat<InputLayers...> Concat(InputLayers&... inputs)
+	{
+		return impl::Concat<InputLayers...>(inputs...);
+	}
+}
@@ -0,0 +1,107 @@
+// memory.h
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#pragma once
+
+#include "util.h"
+
+namespace znn
+{
+	/*
+		where each of a set of buffers (eg. the activations of a model) goes in one shared arena, given
+		the steps that each one is in use for: buffers whose lifetimes don't overlap can use the same
+		memory. the sizes are in scalars per sample -- every activation is some number of scalars for
+		each sample in the batch, so the same plan works for any batch size, with everything scaled by it.
+
+		the buffers are placed biggest first, each at the lowest offset where it doesn't overlap any of
+		the (already placed) buffers that are in use at the same time. for a chain of layers that's
+		predicting, where an activation is only needed until the next layer has run, this comes out as
+		two ping-pong regions, with each layer's output going over the input of the layer before it.
+
+		see Model::memoryPlan, and Session, which keeps all of its activations in one arena like this.
+	*/
+	struct MemoryPlan
+	{
+		struct Buffer
+		{
+			// in scalars per sample.
+			size_t size = 0;
+
+			// the first and last steps that the buffer is in use for (both inclusive).
+			size_t first = 0;
+			size_t last = 0;
+
+			// where it goes in the arena (in scalars per sample); this is filled in by the plan.
+			size_t offset = 0;
+
+			// whether this is another lifetime of an earlier buffer (eg. an activation that gets recomputed),
+			// so it doesn't count towards the naive size again.
+			bool repeat = false;
+		};
+
+		MemoryPlan() { }
+
+		explicit MemoryPlan(std::vector<Buffer> buffers) : buffer_list(std::move(buffers))
+		{
+			auto order = std::vector<size_t>(this->buffer_list.size());
+			std::iota(order.begin(), order.end(), 0);
+
+			std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+				return this->buffer_list[a].size > this->buffer_list[b].size;
+			});
+
+			auto placed = std::vector<const Buffer*>();
+			for(auto i : order)
+			{
+				auto& buf = this->buffer_list[i];
+				assert(buf.first <= buf.last);
+
+				// the buffers that are in use at the same time as this one, from the lowest offset up.
+				auto live = std::vector<const Buffer*>();
+				std::copy_if(placed.begin(), placed.end(), std::back_inserter(live), [&](const Buffer* b) {
+					return b->first <= buf.last && buf.first <= b->last;
+				});
+
+				std::sort(live.begin(), live.end(), [](const Buffer* a, const Buffer* b) {
+					return a->offset < b->offset;
+				});
+
+				// take the first gap that it fits in.
+				size_t offset = 0;
+				for(auto b : live)
+				{
+					if(offset + buf.size <= b->offset)
+						break;
+
+					offset = std::max(offset, b->offset + b->size);
+				}
+
+				buf.offset = offset;
+				placed.push_back(&buf);
+
+				this->arena_size = std::max(this->arena_size, offset + buf.size);
+				this->naive_size += (buf.repeat ? 0 : buf.size);
+			}
+		}
+
+		const std::vector<Buffer>& buffers() const { return this->buffer_list; }
+
+		// the offset of the i-th buffer, in scalars per sample.
+		size_t offset(size_t i) const { return this->buffer_list[i].offset; }
+
+		// the size of the arena, and how much space the buffers would take up if each one had its own
+		// memory (like the layers' own buffers do), in scalars per sample.
+		size_t arenaSize() const { return this->arena_size; }
+		size_t naiveSize() const { return this->naive_size; }
+
+		size_t plannedBytes(size_t batch = 1) const { return sizeof(scalar_t) * batch * this->arena_size; }
+		size_t naiveBytes(size_t batch = 1) const { return sizeof(scalar_t) * batch * this->naive_size; }
+
+	private:
+		std::vector<Buffer> buffer_list;
+
+		size_t arena_size = 0;
+		size_t naive_size = 0;
+	};
+}
@@ -5,29 +5,1359 @@
 #pragma once
 
 #include "util.h"
+#include "memory.h"
+#include "checkpoint.h"
+#include "dataset.h"
+#include "layers/base.h"
+#include "layers/input.h"
 
 namespace znn
 {
+	/*
+		the per-request state for running a model in inference mode, which is just the activations. the
+		layers are only read (see InferenceLayer::infer), so the weights -- and any other state, eg.
+		BatchNorm's moving averages -- stay in the model and are shared; any number of sessions can be
+		predicting on the same model at once, each on its own thread, as long as nothing is training the
+		model at the same time. get one with Model::session.
+
+		all the activations live in one arena, laid out by a MemoryPlan: an activation's memory gets reused
+		for a later one as soon as the last layer that reads it has run. for a chain of layers, that's just
+		two buffers that the layers ping-pong between; for a graph, the outputs of a branch are kept only
+		until the branch has been merged.
+
+		the arena is kept between calls, so it's only reallocated when the batch size changes.
+	*/
+	struct Session
+	{
+		// one layer of the model, and the indices (in the same list) of the layers that it reads from;
+		// the list has to be in topological order (like Model's plan is).
+		struct node_t
+		{
+			const InferenceLayer* layer;
+			std::vector<size_t> inputs;
+		};
+
+		// `owner` is whatever owns the layers, if they don't belong to a Model (see Model::optimiseForInference);
+		// it's kept alive for as long as the session is.
+		Session(std::vector<node_t> nodes, size_t input, size_t output, std::shared_ptr<const void> owner = nullptr)
+			: input_node(input), output_node(output), owner(std::move(owner))
+		{
+			assert(input < nodes.size() && output < nodes.size());
+
+			auto buffers = std::vector<MemoryPlan::Buffer>();
+			for(size_t i = 0; i < nodes.size(); i++)
+			{
+				auto shape = nodes[i].layer->outputShape();
+				auto step = step_t { nodes[i].layer, std::move(nodes[i].inputs), xarr::shape_type(shape.begin(), shape.end()), 0, { } };
+
+				step.size = std::accumulate(step.shape.begin(), step.shape.end(), (size_t) 1, std::multiplies<size_t>());
+				step.args.resize(step.inputs.size());
+
+				// each output is needed from when it's made until the last layer that reads it has run (and
+				// the model's output until the end). the sizes are rounded up to a whole number of simd
+				// vectors, so every buffer starts on a vector boundary.
+				size_t padded = ((step.size + simd::width - 1) / simd::width) * simd::width;
+				buffers.push_back(MemoryPlan::Buffer { padded, i, i });
+
+				for(auto k : step.inputs)
+					buffers[k].last = std::max(buffers[k].last, i);
+
+				this->steps.push_back(std::move(step));
+			}
+
+			buffers[output].last = nodes.size();
+			this->plan = MemoryPlan(std::move(buffers));
+
+			this->input_size = this->steps[input].size;
+			this->output_size = this->steps[output].size;
+		}
+
+		// the views (and the layers' arguments) point into the session's own arena and view list. moving
+		// keeps both of those buffers, so that's fine, but a copy would still be using the original's.
+		Session(Session&&) = default;
+		Session& operator = (Session&&) = default;
+		Session(const Session&) = delete;
+		Session& operator = (const Session&) = delete;
+
+		// runs one input (or a batch of them, with the batch axis first) through the model. the result
+		// is a view of the session's memory, and is only valid until the next call.
+		const xview& predict(const xarr& input)
+		{
+			bool batched = (input.dimension() == this->steps[this->input_node].shape.size() + 1);
+
+			auto& x = this->prepare(batched ? input.shape()[0] : 1, batched);
+			assert(x.size() == input.size());
+
+			std::copy(input.data(), input.data() + input.size(), x.data());
+			return this->forward(batched);
+		}
+
+		// the same as Model::predictBatch, but all on this thread, in one batch.
+		void predictBatch(const scalar_t* inputs, size_t count, scalar_t* out)
+		{
+			auto& batch = this->prepare(count, /* batched: */ true);
+			std::copy(inputs, inputs + (count * this->input_size), batch.data());
+
+			auto& result = this->forward(/* batched: */ true);
+
+			assert(result.size() == count * this->output_size);
+			std::copy(result.data(), result.data() + result.size(), out);
+		}
+
+		// runs one input (inputSize() scalars) through the model, and writes its output to `out`. once
+		// the session has done this before, it doesn't allocate anything: the arena is already the right
+		// size, and the layers work in it in-place. (the same goes for predictBatch, as long as the batch
+		// size doesn't change.)
+		void predict(const scalar_t* input, scalar_t* out)
+		{
+			auto& x = this->prepare(1, /* batched: */ false);
+			std::copy(input, input + this->input_size, x.data());
+
+			auto& result = this->forward(/* batched: */ false);
+			std::copy(result.data(), result.data() + this->output_size, out);
+		}
+
+		// where each layer's output goes in the arena; see MemoryPlan.
+		const MemoryPlan& memoryPlan() const { return this->plan; }
+
+	private:
+		struct step_t
+		{
+			const InferenceLayer* layer;
+			std::vector<size_t> inputs;
+
+			// the shape (and size) of one output.
+			xarr::shape_type shape;
+			size_t size;
+
+			// the inputs, for InferenceLayer::inferAll; this is kept so it doesn't get allocated every time.
+			std::vector<const xview*> args;
+		};
+
+		std::vector<step_t> steps;
+
+		size_t input_node = 0;
+		size_t output_node = 0;
+
+		std::shared_ptr<const void> owner;
+
+		size_t input_size = 0;
+		size_t output_size = 0;
+
+		MemoryPlan plan;
+		aligned_vector arena;
+
+		// a view of each step's output in the arena, for the batch size that they were made for.
+		std::vector<xview> views;
+		size_t view_count = 0;
+		bool view_batched = false;
+
+		// makes the views for `count` samples (or just one, unbatched), and returns the input's. this is
+		// only done when that's different from last time, so the arena doesn't get reallocated otherwise.
+		xview& prepare(size_t count, bool batched)
+		{
+			if(this->views.empty() || count != this->view_count || batched != this->view_batched)
+			{
+				this->views.clear();
+				this->arena.resize(count * this->plan.arenaSize());
+
+				for(size_t i = 0; i < this->steps.size(); i++)
+				{
+					auto shape = this->steps[i].shape;
+					if(batched)
+						shape.insert(shape.begin(), count);
+
+					this->views.push_back(xt::adapt(this->arena.data() + (count * this->plan.offset(i)),
+						count * this->steps[i].size, xt::no_ownership(), shape));
+				}
+
+				for(auto& step : this->steps)
+				{
+					for(size_t k = 0; k < step.inputs.size(); k++)
+						step.args[k] = &this->views[step.inputs[k]];
+				}
+
+				this->view_count = count;
+				this->view_batched = batched;
+			}
+
+			return this->views[this->input_node];
+		}
+
+		const xview& forward(bool batched)
+		{
+			for(size_t i = 0; i < this->steps.size(); i++)
+			{
+				if(i == this->input_node)
+					continue;
+
+				auto& step = this->steps[i];
+				step.layer->inferAll(step.args.data(), this->views[i], batched);
+			}
+
+			return this->views[this->output_node];
+		}
+	};
+
+	/*
+		the model owns all of the trainable parameters of its layers, in one contiguous arena; the
+		gradients live in a second arena with the exact same layout, and the optimiser's state
+		(eg. adam's moments) in a third. the layers only keep views into these (see Parameter).
+
+		this means that an optimiser step is just one linear sweep over the arenas, and that
+		saving or restoring the weights of the whole model is a single copy.
+	*/
 	struct Model
 	{
 		Model(layers::impl::InputLayer& input_layer, Layer& output_layer)
-			: input_layer(input_layer), output_layer(output_layer) { }
+			: Model(std::vector<layers::impl::InputLayer*> { &input_layer }, std::vector<Layer*> { &output_layer })
+		{
+		}
+
+		/*
+			a model with any number of inputs and outputs; the layers in between can be any graph (eg.
+			with residual connections, or towers side by side that get joined with Concat), and a layer's
+			output can go to more than one layer. the model is every layer that the outputs depend on,
+			which has to include all of the inputs.
+
+			each input gets fed with feed(i, x), and each output is read with output(i) after a forward
+			pass. predict, the Sessions, and GDDriver only work with models that have one of each.
+		*/
+		Model(std::vector<layers::impl::InputLayer*> inputs, std::vector<Layer*> outputs)
+		{
+			auto ins = std::vector<Layer*>();
+			for(auto in : inputs)
+				ins.push_back(dynamic_cast<Layer*>(in));
+
+			this->build_plan(ins, outputs);
+			this->bind_parameters();
+		}
+
+		Model(Model&&) = default;
+		Model(const Model&) = delete;
+		Model& operator = (const Model&) = delete;
 
 		xarr predict(const xarr& in)
 		{
-			this->input_layer.feed(in);
-			return xt::eval(this->output_layer.compute(/* training: */ false, /* batched: */ false));
+			// once the model is optimised for inference, only its sessions have the optimised layers.
+			if(this->inference_plan)
+				return this->own_session().predict(in);
+
+			this->feed(0, in);
+			return this->forward(/* training: */ false, /* batched: */ false);
+		}
+
+		// predicts one input (inputSize() scalars) into `out` (outputSize() scalars), using a Session that
+		// the model keeps for itself -- so after the first call, this doesn't allocate (see Session::predict).
+		// like the other predicts, this isn't thread-safe; give each thread its own session instead.
+		void predict(const scalar_t* in, scalar_t* out)
+		{
+			this->own_session().predict(in, out);
+		}
+
+		// runs every input in the dataset through the model, up to batchSize of them at a time (see
+		// predictBatch). the result has the batch axis first, ie. it's (data.size() x output shape).
+		xarr predict(const Dataset& data, size_t batchSize = 256)
+		{
+			assert(batchSize > 0);
+
+			auto shape = this->output_shape;
+			shape.insert(shape.begin(), data.size());
+
+			xarr result = xarr::from_shape(shape);
+			this->predictBatch(data, result.data(), batchSize);
+
+			return result;
+		}
+
+		/*
+			bulk scoring: runs the `count` inputs packed back to back at `inputs` through the model, and
+			writes their outputs, packed the same way, to `out` (which needs space for count * outputSize()
+			scalars). the inputs are split into chunks of up to chunkSize samples (by default, enough to
+			keep a chunk's activations in about 256kb), and the chunks are spread over the global thread
+			pool, with each thread running the batched forward pass in its own Session.
+
+			the results are the same as predict(), since batching doesn't change any of the layers'
+			outputs in inference mode.
+		*/
+		void predictBatch(const scalar_t* inputs, size_t count, scalar_t* out, size_t chunkSize = 0)
+		{
+			if(count == 0)
+				return;
+
+			auto sessions = std::vector<Session>();
+			sessions.push_back(this->session());
+
+			// a session's arena has all of the activations of a sample (including the input).
+			if(chunkSize == 0)
+			{
+				size_t row = std::max((size_t) 1, sessions[0].memoryPlan().plannedBytes());
+				chunkSize = std::clamp(PREDICT_CACHE_BYTES / row, (size_t) 8, (size_t) 1024);
+			}
+
+			auto& pool = util::ThreadPool::global();
+
+			size_t chunks = (count + chunkSize - 1) / chunkSize;
+			size_t threads = std::min(pool.size(), chunks);
+
+			for(size_t t = 1; t < threads; t++)
+				sessions.push_back(this->session());
+
+			auto next = std::atomic<size_t>(0);
+			pool.run(threads, [&](size_t t) {
+				for(size_t c; (c = next.fetch_add(1)) < chunks; )
+				{
+					size_t begin = c * chunkSize;
+					size_t n = std::min(chunkSize, count - begin);
+
+					sessions[t].predictBatch(inputs + (begin * this->input_size), n, out + (begin * this->output_size));
+				}
+			});
+		}
+
+		// same as above, for every input in the dataset.
+		void predictBatch(const Dataset& data, scalar_t* out, size_t chunkSize = 0)
+		{
+			assert(data.inputShape() == this->input_shape);
+			if(!data.empty())
+				this->predictBatch(data.input(0), data.size(), out, chunkSize);
+		}
+
+		// same as above, for a batch of inputs (ie. with the batch axis first).
+		void predictBatch(const xarr& batch, scalar_t* out, size_t chunkSize = 0)
+		{
+			assert(batch.dimension() == this->input_shape.size() + 1);
+			assert(std::equal(batch.shape().begin() + 1, batch.shape().end(), this->input_shape.begin()));
+
+			this->predictBatch(batch.data(), batch.shape()[0], out, chunkSize);
+		}
+
+		// a new session for predicting on this model, possibly from another thread; see Session. if the
+		// model has been optimised for inference, the session runs the optimised layers.
+		Session session()
+		{
+			if(auto& fused = this->inference_plan; fused)
+				return Session(fused->nodes, fused->input, fused->output, fused);
+
+			return this->plain_session();
+		}
+
+		/*
+			how the activations of the model could share one arena (see MemoryPlan), when predicting or when
+			training; the naive size is what it takes for every layer to have its own buffers.
+
+			when predicting, this is the plan that the sessions use. when training, it has every buffer that the
+			layers use: each layer's output, from the forward pass until the backward pass of the layers that
+			read it (and of the layer itself); the errors that each layer returns, one for each input, until that
+			input has run backward; the sum of the errors of an output that more than one layer reads; and the
+			layer's own buffers for backprop (see Layer::backwardBuffers). with checkpointing, the outputs that
+			get recomputed are needed twice; see setCheckpointing.
+
+			but training doesn't actually use this plan -- the layers keep their own buffers. without
+			checkpointing they're all kept for good, so naiveBytes is what training really takes. plannedBytes
+			is only what it would take if they shared one arena; with checkpointing, the buffers get freed as
+			soon as they're not needed anymore, so the real peak is somewhere above that.
+		*/
+		MemoryPlan memoryPlan(bool training)
+		{
+			if(!training)
+				return this->session().memoryPlan();
+
+			// forward runs step i at time i, and backward runs it at time 2n - 1 - i.
+			size_t n = this->plan.size();
+			auto back = [n](size_t i) -> size_t { return (2 * n) - 1 - i; };
+
+			auto outputs = std::vector<MemoryPlan::Buffer>();
+			auto errors = std::vector<MemoryPlan::Buffer>();
+
+			// when the error of each output starts coming in, and from how many places.
+			auto error_first = std::vector<size_t>(n, SIZE_MAX);
+			auto error_count = std::vector<size_t>(n, 0);
+
+			for(size_t i = 0; i < n; i++)
+			{
+				auto& step = this->plan[i];
+
+				// input layers don't need their output in backward, but everything else (might).
+				size_t last = (step.inputs.empty() ? i : back(i));
+				outputs.push_back(MemoryPlan::Buffer { step.size, i, last });
+
+				auto bufs = step.layer->backwardBuffers();
+				if(bufs.kept > 0)
+					errors.push_back(MemoryPlan::Buffer { bufs.kept, i, back(i) });
+
+				if(bufs.scratch > 0)
+					errors.push_back(MemoryPlan::Buffer { bufs.scratch, back(i), back(i) });
+
+				for(auto k : step.inputs)
+				{
+					if(bufs.errors)
+						errors.push_back(MemoryPlan::Buffer { this->plan[k].size, back(i), back(k) });
+
+					error_first[k] = std::min(error_first[k], back(i));
+					error_count[k]++;
+				}
+			}
+
+			for(size_t i = 0; i < n; i++)
+			{
+				for(auto k : this->plan[i].inputs)
+					outputs[k].last = std::max(outputs[k].last, back(i));
+			}
+
+			// the error of the outputs comes from the cost function, right before backward starts.
+			for(auto i : this->output_steps)
+			{
+				outputs[i].last = std::max(outputs[i].last, n);
+				errors.push_back(MemoryPlan::Buffer { this->plan[i].size, n, back(i) });
+
+				error_first[i] = n;
+				error_count[i]++;
+			}
+
+			// when more than one error comes in, they get added up into a buffer of the step's own.
+			for(size_t i = 0; i < n; i++)
+			{
+				if(error_count[i] > 1)
+					errors.push_back(MemoryPlan::Buffer { this->plan[i].size, error_first[i], back(i) });
+			}
+
+			// with checkpointing, the outputs that get recomputed are only around until their segment has run
+			// forward, then again from when backward gets to the segment.
+			auto segment_end = std::vector<size_t>(this->levels.size(), 0);
+			for(size_t i = 0; i < n; i++)
+			{
+				auto& seg = segment_end[this->level_segment[this->plan[i].level]];
+				seg = std::max(seg, i);
+			}
+
+			for(size_t i = 0; i < n; i++)
+			{
+				if(!this->plan[i].recomputed)
+					continue;
+
+				size_t end = segment_end[this->level_segment[this->plan[i].level]];
+				errors.push_back(MemoryPlan::Buffer { this->plan[i].size, back(end), outputs[i].last, 0, /* repeat: */ true });
+				outputs[i].last = end;
+			}
+
+			outputs.insert(outputs.end(), errors.begin(), errors.end());
+			return MemoryPlan(std::move(outputs));
+		}
+
+		struct FusionReport
+		{
+			size_t layersBefore = 0;
+			size_t layersAfter = 0;
+
+			// the largest difference between the outputs of the original and optimised layers, relative to
+			// the size of the output, on a batch of random inputs; the optimised layers only get used if it's
+			// below 4 * sqrt(epsilon), ie. if they only differ by rounding.
+			double maxError = 0;
+			bool applied = false;
+		};
+
+		/*
+			makes the sessions (and so everything that predicts: predict, predictBatch, InferenceQueue) run a
+			simplified copy of the layers, which does the same thing with fewer passes over the activations:
+
+			- layers that don't do anything when predicting (ie. Dropout) are left out.
+			- a BatchNorm (which, when predicting, is a scale and shift of each value) is folded into the Dense
+			  right before it, if that Dense has a Linear activation -- or else into the Dense right after it,
+			  by scaling that Dense's weights and adjusting its biases.
+
+			activations are already applied by the layer that produces them, while its output is in cache (see
+			dense_infer), so there aren't any activation layers to fold. the folded layers have their own copy
+			of the weights, so updating or loading the parameters throws them away again (see
+			forget_inference_plan); call this again afterwards. the original layers aren't touched, so
+			training works as usual.
+		*/
+		FusionReport optimiseForInference()
+		{
+			assert(this->input_steps.size() == 1 && this->output_steps.size() == 1);
+
+			auto fused = this->fuse_layers();
+
+			auto report = FusionReport();
+			report.layersBefore = this->plan.size();
+			report.layersAfter = fused->nodes.size();
+
+			// check that the folded layers give the same outputs as the real ones, on a batch of random inputs.
+			constexpr size_t PROBES = 16;
+
+			auto rng = std::mt19937();
+			auto dist = std::normal_distribution<double>(0, 1);
+
+			auto inputs = aligned_vector(PROBES * this->input_size);
+			for(auto& x : inputs)
+				x = scalar_t(dist(rng));
+
+			auto expected = aligned_vector(PROBES * this->output_size);
+			auto actual = aligned_vector(PROBES * this->output_size);
+
+			this->plain_session().predictBatch(inputs.data(), PROBES, expected.data());
+			Session(fused->nodes, fused->input, fused->output, fused).predictBatch(inputs.data(), PROBES, actual.data());
+
+			double scale = 1;
+			for(auto x : expected)
+				scale = std::max(scale, std::abs((double) x));
+
+			for(size_t i = 0; i < expected.size(); i++)
+			{
+				// a nan counts as a mismatch.
+				double diff = std::abs((double) expected[i] - (double) actual[i]) / scale;
+				report.maxError = std::max(report.maxError, std::isnan(diff) ? std::numeric_limits<double>::infinity() : diff);
+			}
+
+			report.applied = (report.maxError <= 4 * std::sqrt(std::numeric_limits<scalar_t>::epsilon()));
+
+			this->inference_plan = (report.applied ? std::move(fused) : nullptr);
+			this->cached_session.reset();
+
+			return report;
 		}
 
 		void feed_training(const xarr& in)
 		{
-			this->input_layer.feed(in);
+			this->feed(0, in);
+		}
+
+		// sets the i-th input of the model (in the order they were given to the constructor).
+		void feed(size_t i, const xarr& in)
+		{
+			assert(i < this->input_layers.size());
+			this->input_layers[i]->feed(in);
+		}
+
+		/*
+			runs the forward pass of every layer on whatever was last fed to the model, and returns the
+			(first) output. the layers run one level at a time, where a layer's level is the longest path
+			to it from an input; the layers in a level don't depend on each other, so when there's more
+			than one (eg. towers side by side), they run in parallel on the global thread pool.
+		*/
+		const xarr& forward(bool training, bool batched)
+		{
+			auto run = [&](step_t& step) {
+				if(step.inputs.empty())
+				{
+					step.output = &step.layer->forward(step.layer->getLastOutput(), training, batched);
+					return;
+				}
+
+				for(size_t k = 0; k < step.inputs.size(); k++)
+					step.args[k] = this->plan[step.inputs[k]].output;
+
+				step.output = &step.layer->forwardAll(step.args.data(), training, batched);
+			};
+
+			for(size_t l = 0; l < this->levels.size(); l++)
+			{
+				this->run_level(this->levels[l], run);
+
+				// with checkpointing, the outputs that don't leave the segment aren't needed until backward.
+				if(training)
+					this->release_segment(l);
+			}
+
+			return this->output(0);
+		}
+
+		// the i-th output of the model, from the last forward pass.
+		const xarr& output(size_t i) const
+		{
+			assert(i < this->output_steps.size());
+			return *this->plan[this->output_steps[i]].output;
+		}
+
+		// runs the backward pass of every layer, given the error of the output; this has to come right
+		// after a training forward pass, since it uses its outputs. the model must have just one output.
+		void backward(const xarr& error, bool batched)
+		{
+			assert(this->output_steps.size() == 1);
+
+			const xarr* errors[] = { &error };
+			this->backward(errors, batched);
+		}
+
+		/*
+			the same, with the error of each of the outputs. this goes through the levels backwards, so
+			a layer only runs once every layer that reads its output has; when there's more than one of
+			them, their errors get added up. the sums are always done in the same order, so the gradients
+			don't depend on which branch finished first.
+		*/
+		void backward(const xarr* const* errors, bool batched)
+		{
+			for(auto& step : this->plan)
+			{
+				step.error = nullptr;
+				step.received = 0;
+			}
+
+			this->error_holders.clear();
+
+			for(size_t i = 0; i < this->output_steps.size(); i++)
+				this->add_error(this->plan[this->output_steps[i]], *errors[i]);
+
+			auto run = [&](step_t& step) {
+				if(!step.inputs.empty() && step.error != nullptr)
+					step.layer->backpropAll(step.args.data(), *step.error, step.errors.data(), batched);
+			};
+
+			for(size_t l = this->levels.size(); l-- > 0; )
+			{
+				// with checkpointing, we get back the outputs of the segment first (before its last level).
+				this->recompute_segment(l, batched);
+
+				auto& level = this->levels[l];
+				this->run_level(level, run);
+
+				for(auto i : level)
+				{
+					auto& step = this->plan[i];
+					if(step.error == nullptr)
+						continue;
+
+					for(size_t k = 0; k < step.inputs.size(); k++)
+						this->add_error(this->plan[step.inputs[k]], *step.errors[k]);
+				}
+
+				// and once its first level is done, they aren't needed anymore.
+				if(l == 0 || this->segment_ends[l - 1])
+					this->release_segment(this->level_segment[l]);
+
+				if(this->release_backward)
+					this->release_backward_buffers(l);
+			}
+		}
+
+		// whether forward and backward run the independent layers of a level in parallel (the default).
+		void setParallelBranches(bool enable) { this->parallel_branches = enable; }
+
+		// which activations are kept from forward to backward when training; see Checkpointing.
+		void setCheckpointing(const Checkpointing& policy)
+		{
+			auto ends = std::vector<bool>(this->levels.size(), false);
+			switch(policy.kind)
+			{
+				case Checkpointing::Kind::None:
+					break;
+
+				case Checkpointing::Kind::Sqrt: {
+					size_t k = std::max((size_t) 1, (size_t) std::ceil(std::sqrt((double) this->levels.size())));
+					for(size_t l = k - 1; l < ends.size(); l += k)
+						ends[l] = true;
+
+					break;
+				}
+
+				case Checkpointing::Kind::Manual:
+					for(auto layer : policy.layers)
+					{
+						auto it = std::find_if(this->plan.begin(), this->plan.end(), [&](auto& step) {
+							return step.layer == layer;
+						});
+
+						assert(it != this->plan.end() && "checkpoint layer isn't part of the model");
+						ends[it->level] = true;
+					}
+
+					break;
+			}
+
+			this->plan_segments(std::move(ends));
+			this->release_backward = (policy.kind != Checkpointing::Kind::None);
+		}
+
+		Layer* outputLayer()  { return this->plan[this->output_steps[0]].layer; }
+
+		// the shapes of one input and one output of the model (ie. without the batch axis).
+		const std::vector<size_t>& inputShape() const { return this->input_shape; }
+		const std::vector<size_t>& outputShape() const { return this->output_shape; }
+
+		// the number of scalars in one input and one output.
+		size_t inputSize() const { return this->input_size; }
+		size_t outputSize() const { return this->output_size; }
+
+		size_t parameterCount() const { return this->param_count; }
+
+		// whether a batch can be trained as several shards on replicas of the model, and give the same
+		// result; this is false if any of the layers needs the whole batch (see Layer::needsWholeBatch).
+		bool canSplitBatches() const
+		{
+			return std::none_of(this->plan.begin(), this->plan.end(), [](auto& step) {
+				return step.layer->needsWholeBatch();
+			});
 		}
 
-		Layer* outputLayer()  { return &output_layer; }
+		scalar_t* parameters() { return this->param_data; }
+		scalar_t* gradients()  { return this->grad_arena.data(); }
+		const scalar_t* parameters() const { return this->param_data; }
+
+		// restores the parameters from a previous copy of parameters(); note that non-trainable state
+		// (eg. the moving mean and variance of BatchNorm) isn't part of this.
+		void loadParameters(const scalar_t* params)
+		{
+			this->forget_inference_plan();
+			std::copy(params, params + this->param_count, this->param_data);
+		}
+
+		void resetGradients()
+		{
+			std::fill(this->grad_arena.begin(), this->grad_arena.end(), scalar_t(0));
+		}
+
+		// runs one optimiser step over every block of parameters, with the accumulated gradients scaled
+		// by `scale`; the regularisers are applied as part of it. this also resets the gradients.
+		void updateWeights(optimisers::Optimiser* opt, double scale)
+		{
+			// the replicas don't own their parameters, so they can't update them either.
+			assert(!this->is_replica);
+
+			this->forget_inference_plan();
+			this->updateWeights(opt, scale, *this);
+		}
+
+		/*
+			same as above, but the gradients come from `source` (which is either this model, or one of
+			its replicas), and it's source's gradients that get reset.
+
+			this is what Hogwild-style training uses, where every thread calls this for its own replica
+			whenever it likes, without any locking. the updates to the parameters (and to the optimiser
+			state) race with each other and with the other threads' forward passes -- on purpose. a
+			value can end up missing some other thread's update, but with sparse-ish gradients that
+			rarely matters. call prepareOptimiser first, so the state doesn't get allocated concurrently
+			(and the inference plan, which would go stale, doesn't get thrown away concurrently either).
+		*/
+		void updateWeights(optimisers::Optimiser* opt, double scale, Model& source)
+		{
+			assert(source.param_data == this->param_data);
+
+			auto state = this->optimiser_state(opt);
+			auto stride = this->param_count;
+
+			for(auto& blk : this->blocks)
+			{
+				opt->update(optimisers::ParamBlock {
+					this->param_data + blk.offset,
+					source.grad_arena.data() + blk.offset,
+					(state ? state + blk.offset : nullptr),
+					stride, blk.size, blk.l1, blk.l2
+				}, scale);
+			}
+		}
+
+		// makes sure the state for the optimiser exists (resetting it if it was for a different one).
+		void prepareOptimiser(optimisers::Optimiser* opt)
+		{
+			this->forget_inference_plan();
+			this->optimiser_state(opt);
+		}
+
+		/*
+			a copy of the model that shares its parameters with this one, but has its own copy of every
+			layer (so its own activations and scratch buffers) and its own gradient arena. this lets
+			several threads run forward and backward passes at the same time, eg. on different shards
+			of a minibatch; the replicas' gradients then need to be added into this model's before
+			calling updateWeights.
+
+			non-trainable layer state (eg. BatchNorm's moving averages) is copied, not shared -- so models
+			with such layers shouldn't be trained like this (see canSplitBatches).
+		*/
+		Model replicate()
+		{
+			std::vector<std::unique_ptr<Layer>> clones;
+			for(auto& step : this->plan)
+			{
+				auto inputs = std::vector<Layer*>();
+				for(auto k : step.inputs)
+					inputs.push_back(clones[k].get());
+
+				clones.push_back(step.layer->clone(inputs));
+			}
+
+			return Model(std::move(clones), *this);
+		}
 
 	private:
-		layers::impl::InputLayer& input_layer;
-		Layer& output_layer;
+		std::vector<layers::impl::InputLayer*> input_layers;
+
+		// only replicas own their layers; for a normal model, they belong to the caller.
+		std::vector<std::unique_ptr<Layer>> owned_layers;
+		bool is_replica = false;
+
+		bool parallel_branches = true;
+
+		// the clones are in the same order as the original's plan, so they have the same inputs and outputs.
+		Model(std::vector<std::unique_ptr<Layer>> clones, const Model& original)
+			: owned_layers(std::move(clones)), is_replica(true), parallel_branches(original.parallel_branches),
+			  blocks(original.blocks), param_data(original.param_data), param_count(original.param_count)
+		{
+			auto ins = std::vector<Layer*>();
+			for(auto i : original.input_steps)
+				ins.push_back(this->owned_layers[i].get());
+
+			auto outs = std::vector<Layer*>();
+			for(auto i : original.output_steps)
+				outs.push_back(this->owned_layers[i].get());
+
+			this->build_plan(ins, outs);
+			this->plan_segments(original.segment_ends);
+
+			// the layers were cloned from the original, so their parameters are already views of its
+			// arena; we just need to point the gradients at our own.
+			this->grad_arena = aligned_vector(this->param_count, 0);
+
+			auto params = this->collect_parameters();
+			assert(params.size() == this->blocks.size());
+
+			for(size_t i = 0; i < params.size(); i++)
+				params[i]->bind_grads(this->grad_arena.data() + this->blocks[i].offset);
+		}
+
+		std::optional<Session> cached_session;
+
+		Session& own_session()
+		{
+			if(!this->cached_session)
+				this->cached_session.emplace(this->session());
+
+			return *this->cached_session;
+		}
+
+		Session plain_session()
+		{
+			assert(this->input_steps.size() == 1 && this->output_steps.size() == 1);
+
+			auto nodes = std::vector<Session::node_t>();
+			for(auto& step : this->plan)
+				nodes.push_back(Session::node_t { step.layer, step.inputs });
+
+			return Session(std::move(nodes), this->input_steps[0], this->output_steps[0]);
+		}
+
+		// the layers for the sessions of a model that's been optimised for inference (see there); the folded
+		// layers belong to this, and the others to the model.
+		struct inference_plan_t
+		{
+			std::vector<std::unique_ptr<InferenceLayer>> layers;
+			std::vector<Session::node_t> nodes;
+			size_t input;
+			size_t output;
+		};
+
+		std::shared_ptr<const inference_plan_t> inference_plan;
+
+		// the folded layers have their own copy of the weights, so once the weights change they're out of
+		// date; predicting goes back to the original layers until optimiseForInference is called again.
+		// sessions that were already made keep the old weights.
+		void forget_inference_plan()
+		{
+			if(!this->inference_plan)
+				return;
+
+			this->inference_plan = nullptr;
+			this->cached_session.reset();
+		}
+
+		std::shared_ptr<inference_plan_t> fuse_layers() const
+		{
+			auto ret = std::make_shared<inference_plan_t>();
+
+			struct node_t
+			{
+				const InferenceLayer* layer;
+				std::vector<size_t> inputs;
+				bool live;
+			};
+
+			auto nodes = std::vector<node_t>();
+			for(auto& step : this->plan)
+				nodes.push_back(node_t { step.layer, step.inputs, true });
+
+			size_t input = this->input_steps[0];
+			size_t output = this->output_steps[0];
+
+			// first, skip over the identities: whatever reads one reads its input instead.
+			auto source = std::vector<size_t>(nodes.size());
+			for(size_t i = 0; i < nodes.size(); i++)
+			{
+				auto& node = nodes[i];
+				for(auto& k : node.inputs)
+					k = source[k];
+
+				source[i] = i;
+				if(node.inputs.size() == 1 && node.layer->fusable().kind == Fusable::Kind::Identity)
+				{
+					source[i] = node.inputs[0];
+					node.live = false;
+				}
+			}
+
+			output = source[output];
+
+			// the layers that read the output of layer i (once for each time they read it).
+			auto readers = [&](size_t i) -> std::vector<size_t> {
+				auto ret = std::vector<size_t>();
+				for(size_t j = 0; j < nodes.size(); j++)
+				{
+					if(!nodes[j].live)
+						continue;
+
+					for(auto k : nodes[j].inputs)
+						if(k == i) ret.push_back(j);
+				}
+
+				return ret;
+			};
+
+			// then fold each affine layer into a dense one on either side, when that's the only layer
+			// it's connected to on that side. the folded layer takes the place of the later of the two.
+			for(size_t i = 0; i < nodes.size(); i++)
+			{
+				if(!nodes[i].live || i == input || i == output)
+					continue;
+
+				auto next = readers(i);
+				if(next.size() != 1 || nodes[next[0]].inputs.size() != 1)
+					continue;
+
+				auto a = nodes[i].layer->fusable();
+				auto b = nodes[next[0]].layer->fusable();
+
+				std::unique_ptr<InferenceLayer> folded;
+				if(a.kind == Fusable::Kind::Dense && a.linear && b.kind == Fusable::Kind::Affine && b.inputs == a.outputs)
+				{
+					// scale each output (ie. row of the weights) of the dense layer.
+					auto w = xarr::from_shape({ a.outputs, a.inputs });
+					auto bias = xarr::from_shape({ a.outputs });
+
+					for(size_t r = 0; r < a.outputs; r++)
+					{
+						for(size_t c = 0; c < a.inputs; c++)
+							w(r, c) = a.weights[(r * a.inputs) + c] * b.scale[r];
+
+						bias(r) = (a.biases[r] * b.scale[r]) + b.shift[r];
+					}
+
+					folded = a.make(std::move(w), std::move(bias));
+				}
+				else if(a.kind == Fusable::Kind::Affine && b.kind == Fusable::Kind::Dense && b.inputs == a.outputs)
+				{
+					// scale each input (ie. column of the weights) of the dense layer; the shifts all end up
+					// in the biases.
+					auto w = xarr::from_shape({ b.outputs, b.inputs });
+					auto bias = xarr::from_shape({ b.outputs });
+
+					for(size_t r = 0; r < b.outputs; r++)
+					{
+						scalar_t sum = b.biases[r];
+						for(size_t c = 0; c < b.inputs; c++)
+						{
+							auto x = b.weights[(r * b.inputs) + c];
+							w(r, c) = x * a.scale[c];
+							sum += x * a.shift[c];
+						}
+
+						bias(r) = sum;
+					}
+
+					folded = b.make(std::move(w), std::move(bias));
+				}
+				else
+				{
+					continue;
+				}
+
+				nodes[next[0]].layer = folded.get();
+				nodes[next[0]].inputs = nodes[i].inputs;
+				nodes[i].live = false;
+
+				ret->layers.push_back(std::move(folded));
+			}
+
+			// and finally, number the layers that are left.
+			auto index = std::vector<size_t>(nodes.size(), SIZE_MAX);
+			for(size_t i = 0; i < nodes.size(); i++)
+			{
+				if(!nodes[i].live)
+					continue;
+
+				auto node = Session::node_t { nodes[i].layer, { } };
+				for(auto k : nodes[i].inputs)
+					node.inputs.push_back(index[k]);
+
+				index[i] = ret->nodes.size();
+				ret->nodes.push_back(std::move(node));
+			}
+
+			ret->input = index[input];
+			ret->output = index[output];
+
+			return ret;
+		}
+
+		// how much of the cache predictBatch tries to keep each chunk in.
+		static constexpr size_t PREDICT_CACHE_BYTES = 256 * 1024;
+
+		std::vector<size_t> input_shape;
+		std::vector<size_t> output_shape;
+		size_t input_size = 0;
+		size_t output_size = 0;
+
+		static size_t shape_size(const std::vector<size_t>& shape)
+		{
+			return std::accumulate(shape.begin(), shape.end(), (size_t) 1, std::multiplies<size_t>());
+		}
+
+		/*
+			the layers, in an order that they can run in (every layer comes after its inputs), along with
+			the shape of each one's output; this gets worked out once, when the model is made, so forward
+			and backward are just loops over it (instead of recursing through the graph every time).
+
+			`output` is what each layer returned in the last forward pass, which is what backward gives
+			the layers that read it as their input. it's usually the layer's own last_output, but not
+			always (eg. Dropout passes its input straight through when it's not training).
+		*/
+		struct step_t
+		{
+			Layer* layer;
+			std::vector<size_t> shape;
+			size_t size;
+
+			// the steps that this layer reads from (in the layer's order), and its level (see forward).
+			std::vector<size_t> inputs;
+			size_t level;
+
+			const xarr* output;
+
+			// the outputs of the inputs, and their errors, for forwardAll and backpropAll.
+			std::vector<const xarr*> args;
+			std::vector<const xarr*> errors;
+
+			// the error of this layer's output, during backward; when more than one layer reads it, their
+			// errors are added up in error_sum.
+			const xarr* error;
+			size_t received;
+			xarr error_sum;
+
+			// whether the output is freed after forward, and recomputed in backward; see Checkpointing.
+			bool recomputed;
+		};
+
+		std::vector<step_t> plan;
+
+		// the steps in each level, in plan order.
+		std::vector<std::vector<size_t>> levels;
+
+		std::vector<size_t> input_steps;
+		std::vector<size_t> output_steps;
+
+		void build_plan(const std::vector<Layer*>& inputs, const std::vector<Layer*>& outputs)
+		{
+			assert(!inputs.empty() && !outputs.empty());
+
+			// a depth-first walk from the outputs, where a layer goes into the plan once all its inputs have.
+			auto index = std::unordered_map<Layer*, size_t>();
+			auto stack = std::vector<std::pair<Layer*, size_t>>();
+
+			for(auto out : outputs)
+				stack.emplace_back(out, 0);
+
+			while(!stack.empty())
+			{
+				auto [ layer, next ] = stack.back();
+				if(index.count(layer) > 0)
+				{
+					stack.pop_back();
+				}
+				else if(next < layer->inputs().size())
+				{
+					stack.back().second++;
+					stack.emplace_back(layer->inputs()[next], 0);
+				}
+				else
+				{
+					auto step = step_t { layer, layer->outputShape(), 0, { }, 0, nullptr, { }, { }, nullptr, 0, { }, false };
+					step.size = shape_size(step.shape);
+
+					for(auto in : layer->inputs())
+					{
+						auto k = index.at(in);
+						step.inputs.push_back(k);
+						step.level = std::max(step.level, this->plan[k].level + 1);
+					}
+
+					step.args.resize(step.inputs.size());
+					step.errors.resize(step.inputs.size());
+
+					index[layer] = this->plan.size();
+					this->plan.push_back(std::move(step));
+
+					stack.pop_back();
+				}
+			}
+
+			for(auto in : inputs)
+			{
+				assert(in != nullptr && index.count(in) > 0);
+				this->input_steps.push_back(index.at(in));
+				this->input_layers.push_back(dynamic_cast<layers::impl::InputLayer*>(in));
+			}
+
+			for(auto out : outputs)
+				this->output_steps.push_back(index.at(out));
+
+			for(size_t i = 0; i < this->plan.size(); i++)
+			{
+				auto& step = this->plan[i];
+
+				// a layer without inputs that isn't one of the model's inputs wouldn't have anything to run on.
+				assert(!step.inputs.empty() || std::find(this->input_steps.begin(), this->input_steps.end(), i)
+					!= this->input_steps.end());
+
+				if(step.level >= this->levels.size())
+					this->levels.resize(step.level + 1);
+
+				this->levels[step.level].push_back(i);
+			}
+
+			this->plan_segments(std::vector<bool>(this->levels.size(), false));
+
+			auto& in = this->plan[this->input_steps[0]];
+			auto& out = this->plan[this->output_steps[0]];
+
+			this->input_shape = in.shape;
+			this->output_shape = out.shape;
+
+			this->input_size = in.size;
+			this->output_size = out.size;
+		}
+
+		/*
+			the segments for checkpointing: segment_ends says which levels end a segment (the last one always
+			does), and level_segment is the last level of the segment that each level is in. the steps that
+			get recomputed are listed under the last level of their segment, in plan order (so every step
+			comes after its inputs). the last segment never has any, since backward starts with it anyway.
+		*/
+		std::vector<bool> segment_ends;
+		std::vector<size_t> level_segment;
+		std::vector<std::vector<size_t>> segment_steps;
+
+		void plan_segments(std::vector<bool> ends)
+		{
+			assert(ends.size() == this->levels.size());
+			ends.back() = true;
+
+			this->segment_ends = std::move(ends);
+			this->level_segment.assign(this->levels.size(), 0);
+			this->segment_steps.assign(this->levels.size(), { });
+
+			for(size_t l = this->levels.size(), seg = 0; l-- > 0; )
+			{
+				if(this->segment_ends[l])
+					seg = l;
+
+				this->level_segment[l] = seg;
+			}
+
+			// an output is only recomputed if it stays inside its segment; the model's inputs and outputs
+			// are always kept.
+			auto leaves = std::vector<bool>(this->plan.size(), false);
+			for(auto i : this->output_steps)
+				leaves[i] = true;
+
+			for(auto& step : this->plan)
+			{
+				for(auto k : step.inputs)
+				{
+					if(this->level_segment[this->plan[k].level] != this->level_segment[step.level])
+						leaves[k] = true;
+				}
+			}
+
+			for(size_t i = 0; i < this->plan.size(); i++)
+			{
+				auto& step = this->plan[i];
+				size_t seg = this->level_segment[step.level];
+
+				step.recomputed = !leaves[i] && !step.inputs.empty() && seg != this->levels.size() - 1;
+				if(step.recomputed)
+					this->segment_steps[seg].push_back(i);
+			}
+		}
+
+		void release_segment(size_t seg)
+		{
+			for(auto i : this->segment_steps[seg])
+				this->plan[i].layer->releaseOutput();
+		}
+
+		/*
+			with checkpointing, the buffers that backward uses are freed as soon as it's done with them, instead
+			of being kept for the next pass: the layers' scratch right after their level has run, and the errors
+			that a layer returned once nothing that's still to run reads them. that's usually once the layers
+			they went to have run, but a layer can pass an error it was given straight through (eg. Add), so
+			we look at the errors that are still waiting to be used -- those of the inputs of the layers that
+			still hold on to theirs. without checkpointing, everything is kept, so training doesn't allocate.
+		*/
+		bool release_backward = false;
+		std::vector<size_t> error_holders;
+
+		void release_backward_buffers(size_t level)
+		{
+			for(auto i : this->levels[level])
+			{
+				this->plan[i].layer->releaseScratch();
+				if(this->plan[i].error != nullptr)
+					this->error_holders.push_back(i);
+			}
+
+			auto waiting = std::vector<const xarr*>();
+			for(auto h : this->error_holders)
+			{
+				for(auto k : this->plan[h].inputs)
+				{
+					if(this->plan[k].level < level && this->plan[k].error != nullptr)
+						waiting.push_back(this->plan[k].error);
+				}
+			}
+
+			auto is_waiting = [&](const xarr* err) {
+				return std::find(waiting.begin(), waiting.end(), err) != waiting.end();
+			};
+
+			auto it = std::remove_if(this->error_holders.begin(), this->error_holders.end(), [&](size_t h) {
+				auto& step = this->plan[h];
+				if(std::any_of(step.errors.begin(), step.errors.end(), is_waiting))
+					return false;
+
+				step.layer->releaseErrors();
+				step.error_sum = xarr::from_shape({ 0 });
+				return true;
+			});
+
+			this->error_holders.erase(it, this->error_holders.end());
+		}
+
+		void recompute_segment(size_t seg, bool batched)
+		{
+			for(auto i : this->segment_steps[seg])
+			{
+				auto& step = this->plan[i];
+				step.output = &step.layer->recompute(step.args.data(), batched);
+			}
+		}
+
+		template <typename Fn>
+		void run_level(const std::vector<size_t>& level, Fn&& fn)
+		{
+			if(this->parallel_branches && level.size() > 1)
+			{
+				util::parallel_for(level.size(), [&](size_t i) { fn(this->plan[level[i]]); });
+			}
+			else
+			{
+				for(auto i : level)
+					fn(this->plan[i]);
+			}
+		}
+
+		// the first error is just kept as it is, and only copied when a second one needs adding to it.
+		void add_error(step_t& step, const xarr& error)
+		{
+			if(step.received++ == 0)
+			{
+				step.error = &error;
+				return;
+			}
+
+			auto& sum = step.error_sum;
+			if(step.received == 2)
+			{
+				if(!zfu::equal(sum.shape(), step.error->shape()))
+					sum.resize(step.error->shape());
+
+				std::copy(step.error->data(), step.error->data() + step.error->size(), sum.data());
+				step.error = &sum;
+			}
+
+			assert(error.size() == sum.size());
+
+			auto out = sum.data();
+			auto in = error.data();
+			simd::each(sum.size(), [&](size_t i, auto lanes) {
+				using V = typename decltype(lanes)::type;
+				simd::store<V>(out + i, simd::load<V>(out + i) + simd::load<V>(in + i));
+			});
+		}
+
+		struct block_t
+		{
+			size_t offset;
+			size_t size;
+			scalar_t l1;
+			scalar_t l2;
+		};
+
+		std::vector<block_t> blocks;
+
+		aligned_vector param_arena;
+		aligned_vector grad_arena;
+
+		// for replicas, these point at the original's param_arena (and ours is empty).
+		scalar_t* param_data = nullptr;
+		size_t param_count = 0;
+
+		aligned_vector state_arena;
+		optimisers::Optimiser* state_owner = nullptr;
+
+		std::vector<Parameter*> collect_parameters()
+		{
+			std::vector<Parameter*> params;
+			for(auto& step : this->plan)
+			{
+				auto ps = step.layer->parameters();
+				params.insert(params.end(), ps.begin(), ps.end());
+			}
+
+			return params;
+		}
+
+		void bind_parameters()
+		{
+			auto params = this->collect_parameters();
+
+			size_t total = 0;
+			for(auto p : params)
+			{
+				this->blocks.push_back(block_t { total, p->size(), p->l1, p->l2 });
+				total += p->size();
+			}
+
+			this->param_arena = aligned_vector(total, 0);
+			this->grad_arena = aligned_vector(total, 0);
+
+			this->param_data = this->param_arena.data();
+			this->param_count = total;
+
+			for(size_t i = 0; i < params.size(); i++)
+			{
+				auto ofs = this->blocks[i].offset;
+				params[i]->bind(this->param_arena.data() + ofs, this->grad_arena.data() + ofs);
+			}
+		}
+
+		// the state is reset whenever a different optimiser is used with the model.
+		scalar_t* optimiser_state(optimisers::Optimiser* opt)
+		{
+			size_t size = opt->stateSize() * this->param_count;
+			if(this->state_owner != opt || this->state_arena.size() != size)
+			{
+				this->state_arena = aligned_vector(size, 0);
+				this->state_owner = opt;
+			}
+
+			return (size > 0 ? this->state_arena.data() : nullptr);
+		}
 	};
 }
@@ -22,21 +22,15 @@ namespace znn::optimisers
 		}
 
 	private:
-		using LayerGradMap = std::unordered_map<Layer*, xarr>;
-
 		CostFn costFn;
 		const double beta1 = 0;
 		const double beta2 = 0;
 		const double epsilon = 0;
 
-		struct Params
-		{
-			xarr grad_avg;
-			xarr grad2_avg;
-		};
-
 		double timestep = 0;
-		std::unordered_map<Layer*, Params> params;
+
+		// the moment estimates aren't meant to be updated out of order; see ENABLE_ASYNC.
+		static constexpr bool AsyncSafe = false;
 
 		void setup()
 		{
@@ -45,25 +39,39 @@ namespace znn::optimisers
 			// this->timestep = 0;
 		}
 
-		virtual void computeDeltas(Layer* layer, xarr& dw, xarr& db) override
+		// the state is the first moment (average gradient), followed by the second (average squared gradient).
+		virtual size_t stateSize() override { return 2; }
+
+		virtual void update(const ParamBlock& blk, double scale) override
 		{
-			auto& [ g1, g2 ] = this->params[layer];
+			auto b1 = scalar_t(this->beta1);
+			auto b2 = scalar_t(this->beta2);
+			auto eps = scalar_t(this->epsilon);
+
+			// the bias corrections are per-step constants, so rather than dividing both moments, fold them
+			// in: (m / c1) / (sqrt(v / c2) + eps) == m * (1 / c1) / (sqrt(v) * (1 / sqrt(c2)) + eps).
+			auto c1 = scalar_t(1.0 / (1.0 - std::pow(this->beta1, this->timestep)));
+			auto c2 = scalar_t(1.0 / std::sqrt(1.0 - std::pow(this->beta2, this->timestep)));
+
+			auto g1 = blk.state;
+			auto g2 = blk.state + blk.stride;
 
-			g1 = (this->beta1 * g1) + ((1.0 - this->beta1) * dw);
-			g2 = (this->beta2 * g2) + ((1.0 - this->beta2) * xt::square(dw));
+			fused_update(blk, scale, [&](size_t i, auto dw) {
+				using V = decltype(dw);
 
-			xarr mk = g1 / (1.0 - std::pow(beta1, timestep));
-			xarr rk = g2 / (1.0 - std::pow(beta2, timestep));
+				V m = (b1 * simd::load<V>(g1 + i)) + ((scalar_t(1) - b1) * dw);
+				V v = (b2 * simd::load<V>(g2 + i)) + ((scalar_t(1) - b2) * dw * dw);
+				simd::store<V>(g1 + i, m);
+				simd::store<V>(g2 + i, v);
 
-			dw = mk / (xt::sqrt(rk) + this->epsilon);
-			(void) db;
+				return (m * c1) / (xsimd::sqrt(v) * c2 + eps);
+			});
 		}
 
-		void update_weights(size_t samples, Layer* last)
+		void update_weights(size_t samples, Model& model)
 		{
 			timestep += 1.0;
-			last->updateWeights(this, this->learningRate / (double) samples);
-			last->resetDeltas();
+			model.updateWeights(this, this->learningRate / (double) samples);
 		}
 	};
 }
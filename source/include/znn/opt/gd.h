@@ -7,6 +7,9 @@
 #include "../cost.h"
 #include "../util.h"
 #include "../model.h"
+#include "../stream.h"
+#include "../shuffle.h"
+#include "../dataset.h"
 
 // the definition of the interface Optimiser lives in there, for reasons.
 #include "../layers/base.h"
@@ -30,6 +33,51 @@ namespace znn::optimisers
 		return foo;
 	}
 
+	// how many threads each minibatch gets split across. each thread trains its shard of the batch
+	// on its own replica of the model (see Model::replicate), and their gradients are summed before the
+	// update -- so apart from rounding, the result is the same as training the batch on one thread.
+	// models with layers that need to see the whole batch (eg. BatchNorm; see Model::canSplitBatches)
+	// are always trained on one thread. (Dropout still works, but each replica draws its own masks.)
+	inline size_t& TRAINING_THREADS()
+	{
+		static size_t foo = 1;
+		return foo;
+	}
+
+	// in batched mode, the batches are assembled (and preprocessed; see GDDriver::setPreprocessor) on a
+	// background thread, up to this many batches ahead of the training. 0 does it inline instead. the
+	// batches come out in the same order either way, so this doesn't change the results.
+	inline size_t& PREFETCH_DEPTH()
+	{
+		static size_t foo = 2;
+		return foo;
+	}
+
+	/*
+		hogwild-style asynchronous training, for VanillaGD and StochasticGD (the others just ignore it).
+		instead of splitting each minibatch, every one of the TRAINING_THREADS() threads takes whole
+		minibatches off a shared queue, trains them on its own replica of the model, and applies its
+		update straight to the shared weights without any locking (see Model::updateWeights). the
+		results are not deterministic, even with a fixed seed. (like above, models that can't split
+		their batches across replicas are just trained on one thread.)
+
+		ASYNC_MAX_STALENESS() bounds how far ahead of the slowest thread any thread can get, in
+		updates (ie. stale-synchronous): a thread that has done more than that many updates beyond
+		the slowest one waits for it to catch up. 0 keeps them in lock-step, and the default of
+		SIZE_MAX leaves them unbounded.
+	*/
+	inline bool& ENABLE_ASYNC()
+	{
+		static bool foo = false;
+		return foo;
+	}
+
+	inline size_t& ASYNC_MAX_STALENESS()
+	{
+		static size_t foo = SIZE_MAX;
+		return foo;
+	}
+
 	template <typename CostFn, typename Specialisation>
 	struct GDDriver
 	{
@@ -46,6 +94,30 @@ namespace znn::optimisers
 
 		std::mt19937 rng;
 
+		// the replicas used by the other threads (the first shard is always trained on the model itself).
+		std::vector<Model> replicas;
+		const scalar_t* replicas_of = nullptr;
+
+		// the batch buffers for each thread, which are reused from batch to batch.
+		struct batch_buffers_t
+		{
+			xarr x;
+			xarr y;
+		};
+
+		std::vector<batch_buffers_t> buffers;
+
+		// the slots for the prefetcher; each one holds one batch, split into the shards for each thread.
+		std::vector<std::vector<batch_buffers_t>> prefetched;
+
+		// the prefetcher itself, whose thread is kept around for every pass (and every chunk of a
+		// SampleSource), so we don't start a new one each time.
+		using prefetcher_t = util::Pipeline<std::vector<batch_buffers_t>>;
+		std::unique_ptr<prefetcher_t> prefetcher;
+
+		std::function<void(xarr&, xarr&)> preprocess;
+		Shuffle shuffle = Shuffle::full();
+
 		struct layer_deltas_t
 		{
 			xarr d_weight;
@@ -55,96 +127,325 @@ namespace znn::optimisers
 		void train_one_sample(Model& model, const xarr& input, const xarr& target)
 		{
 			model.feed_training(input);
-			auto out_layer = model.outputLayer();
-			auto prediction = out_layer->compute(/* training: */ true, /* batched: */ false);
+			auto& prediction = model.forward(/* training: */ true, /* batched: */ false);
 
 			assert(target.shape() == prediction.shape());
 
 			xarr error = this->spec.costFn.derivative(target, prediction);
-			out_layer->backward(error, /* batched: */ false);
+			model.backward(error, /* batched: */ false);
+		}
+
+		// copies the samples indices[begin..end) into a batch, and preprocesses it.
+		void load_batch(const Dataset& data, const std::vector<size_t>& indices, size_t begin, size_t end,
+			batch_buffers_t& buf)
+		{
+			data.gather(indices.data() + begin, end - begin, buf.x, buf.y);
+			if(this->preprocess)
+				this->preprocess(buf.x, buf.y);
+		}
+
+		void train_batch(Model& model, const batch_buffers_t& buf)
+		{
+			model.feed_training(buf.x);
+			auto& prediction = model.forward(/* training: */ true, /* batched: */ true);
+
+			assert(buf.y.shape() == prediction.shape());
+
+			xarr error = this->spec.costFn.derivative(buf.y, prediction);
+			model.backward(error, /* batched: */ true);
+		}
+
+		// does the forward and backward passes for the samples indices[begin..end), accumulating the
+		// gradients in the given model (or replica). the samples get copied into `buf` first.
+		void train_shard(Model& model, const Dataset& data, const std::vector<size_t>& indices,
+			size_t begin, size_t end, batch_buffers_t& buf)
+		{
+			// in batched mode, the inputs and outputs gain an extra dimension; the first axis is now the batch
+			// size. putting it first obviously allows us to take advantage of broadcasting etc, and the rest of
+			// the code doesn't really need to care.
+			if(ENABLE_BATCHED())
+			{
+				this->load_batch(data, indices, begin, end, buf);
+				this->train_batch(model, buf);
+			}
+			else
+			{
+				for(size_t i = begin; i < end; i++)
+				{
+					data.sample(indices[i], buf.x, buf.y);
+					if(this->preprocess)
+						this->preprocess(buf.x, buf.y);
+
+					this->train_one_sample(model, buf.x, buf.y);
+				}
+			}
+		}
+
+		// makes sure we have (at least) `count` replicas of the model. they're kept around between
+		// calls to run, as long as it's the same model.
+		void prepare_replicas(Model& model, size_t count)
+		{
+			if(this->replicas_of != model.parameters())
+			{
+				this->replicas.clear();
+				this->replicas_of = model.parameters();
+			}
+
+			while(this->replicas.size() < count)
+				this->replicas.push_back(model.replicate());
+		}
+
+		// adds the gradients of the first `count` replicas into the model's, as a binary tree: at each
+		// level, gradient buffer i takes in buffer i + stride, and all the pairs go in parallel. the
+		// buffers that get added in are zeroed in the same pass, ready for the next batch.
+		void reduce_gradients(Model& model, size_t count)
+		{
+			auto buffer = [&](size_t i) -> scalar_t* {
+				return (i == 0 ? model.gradients() : this->replicas[i - 1].gradients());
+			};
+
+			size_t size = model.parameterCount();
+			size_t buffers = count + 1;
+
+			for(size_t stride = 1; stride < buffers; stride *= 2)
+			{
+				size_t pairs = (buffers - stride + (2 * stride) - 1) / (2 * stride);
+				util::parallel_for(pairs, [&](size_t p) {
+					auto dst = buffer(p * 2 * stride);
+					auto src = buffer(p * 2 * stride + stride);
+
+					simd::each(size, [&](size_t i, auto lanes) {
+						using V = typename decltype(lanes)::type;
+						simd::store<V>(dst + i, simd::load<V>(dst + i) + simd::load<V>(src + i));
+						simd::store<V>(src + i, V(scalar_t(0)));
+					});
+				});
+			}
+		}
+
+		void run_async(Model& model, const Dataset& data, const std::vector<size_t>& indices, size_t threads)
+		{
+			this->prepare_replicas(model, threads - 1);
+			model.prepareOptimiser(&this->spec);
+			this->buffers.resize(std::max(this->buffers.size(), threads));
+
+			size_t count = indices.size();
+			auto cursor = std::atomic<size_t>(0);
+
+			// the number of updates each thread has done; a thread that's finished bows out by
+			// setting its clock to the max, so nobody waits for it.
+			auto clocks = std::make_unique<std::atomic<size_t>[]>(threads);
+			auto too_far_ahead = [&](size_t clock, size_t bound) -> bool {
+				if(bound == SIZE_MAX)
+					return false;
+
+				size_t slowest = SIZE_MAX;
+				for(size_t t = 0; t < threads; t++)
+					slowest = std::min(slowest, clocks[t].load(std::memory_order_relaxed));
+
+				return slowest != SIZE_MAX && clock > slowest + bound;
+			};
+
+			auto worker = [&](size_t t) {
+				auto& m = (t == 0 ? model : this->replicas[t - 1]);
+				size_t bound = ASYNC_MAX_STALENESS();
+
+				while(true)
+				{
+					size_t clock = clocks[t].load(std::memory_order_relaxed);
+					while(too_far_ahead(clock, bound))
+						std::this_thread::yield();
+
+					size_t begin = cursor.fetch_add(this->batchSize, std::memory_order_relaxed);
+					if(begin >= count)
+						break;
+
+					size_t end = std::min(count, begin + this->batchSize);
+					this->train_shard(m, data, indices, begin, end, this->buffers[t]);
+
+					model.updateWeights(&this->spec, this->learningRate / (double) (end - begin), m);
+					clocks[t].store(clock + 1, std::memory_order_relaxed);
+				}
+
+				clocks[t].store(SIZE_MAX, std::memory_order_relaxed);
+			};
+
+			// these threads wait on each other, so they can't go through the thread pool (which might
+			// run some of them one after the other, on the same thread).
+			std::vector<std::thread> workers;
+			for(size_t t = 1; t < threads; t++)
+				workers.emplace_back(worker, t);
+
+			worker(0);
+			for(auto& w : workers)
+				w.join();
 		}
 
 	public:
+		// this packs the samples into a Dataset on every call (see znn::train).
 		void run(Model& model, const std::vector<xarr>& inputs, const std::vector<xarr>& targets)
 		{
 			assert(inputs.size() == targets.size());
 			if(inputs.empty())
 				return;
 
-			auto batched_shape = [this](auto& shape) -> std::vector<size_t> {
-				auto ret = std::vector<size_t>(shape.begin(), shape.end());
-				ret.insert(ret.begin(), this->batchSize);
-				return ret;
-			};
+			this->run(model, Dataset(inputs, targets));
+		}
 
-			auto x_shape = batched_shape(inputs[0].shape());
-			auto y_shape = batched_shape(targets[0].shape());
+		void run(Model& model, const Dataset& data)
+		{
+			if(data.empty())
+				return;
 
-			size_t count = inputs.size();
-			size_t index = 0;
-			auto indices = std::vector<size_t>(count);
+			auto indices = std::vector<size_t>();
+			this->shuffle.permute(indices, data.size(), data.inputSize() * sizeof(scalar_t), this->rng);
+
+			// let the specialisation setup any per-batch metrics (eg. velocity)
+			this->spec.setup();
+
+			this->train_samples(model, data, indices);
+		}
+
+		// does one pass over the source (rewinding it first). the samples are read in chunks of a few
+		// batches at a time, and trained on in the order they come out (see ShuffleBuffer), so only
+		// the current chunk needs to be in memory.
+		void run(Model& model, SampleSource& source)
+		{
+			source.rewind();
+			this->spec.setup();
+
+			if(!this->chunk || this->chunk->inputShape() != source.inputShape()
+				|| this->chunk->targetShape() != source.targetShape())
+			{
+				this->chunk.emplace(source.inputShape(), source.targetShape());
+			}
+
+			auto& chunk = *this->chunk;
+
+			// a whole number of batches, so they line up the same way as they would without chunking.
+			size_t capacity = this->batchSize * std::max((size_t) 1, CHUNK_BATCHES);
+
+			auto indices = std::vector<size_t>();
+			while(true)
 			{
+				chunk.resize(capacity);
+
+				size_t n = 0;
+				while(n < capacity && source.next(chunk.mutableInput(n), chunk.mutableTarget(n)))
+					n++;
+
+				if(n == 0)
+					break;
+
+				chunk.resize(n);
+				indices.resize(n);
 				std::iota(indices.begin(), indices.end(), 0);
-				std::shuffle(indices.begin(), indices.end(), this->rng);
+
+				this->train_samples(model, chunk, indices);
+
+				if(n < capacity)
+					break;
 			}
+		}
 
-			size_t remaining = count;
-			size_t todo = std::min(remaining, this->batchSize);
+		// sets the order that the samples of a Dataset are trained in, for each pass; see Shuffle. this
+		// doesn't affect SampleSources, which are always read in order.
+		void setShuffle(Shuffle strategy)
+		{
+			this->shuffle = strategy;
+		}
 
-			// let the specialisation setup any per-batch metrics (eg. velocity)
-			this->spec.setup();
+		// sets a function that gets called on every batch (x, y) before it's trained on. in batched mode
+		// with prefetching, it runs on the prefetcher's thread, one batch at a time, in order.
+		void setPreprocessor(std::function<void(xarr& x, xarr& y)> fn)
+		{
+			this->preprocess = std::move(fn);
+		}
+
+	protected:
+		// how many batches to read from a SampleSource at a time.
+		static constexpr size_t CHUNK_BATCHES = 16;
+
+		// the buffer that SampleSources get read into, reused between chunks and passes.
+		std::optional<Dataset> chunk;
+
+		// trains on the samples data[indices[0]], data[indices[1]], ..., in batches.
+		void train_samples(Model& model, const Dataset& data, const std::vector<size_t>& indices)
+		{
+			size_t count = indices.size();
+
+			size_t max_threads = (model.canSplitBatches() ? TRAINING_THREADS() : 1);
+
+			if constexpr (Specialisation::AsyncSafe)
+			{
+				if(ENABLE_ASYNC() && max_threads > 1)
+					return this->run_async(model, data, indices, max_threads);
+			}
+
+			size_t threads = std::max((size_t) 1, std::min(max_threads, this->batchSize));
+			if(threads > 1)
+				this->prepare_replicas(model, threads - 1);
+
+			this->buffers.resize(std::max(this->buffers.size(), threads));
+
+			// batch b is the samples indices[b * batchSize ..], split into contiguous shards, one per thread;
+			// shard 0 goes to the model itself, and shard k to replica k-1.
+			size_t batches = (count + this->batchSize - 1) / this->batchSize;
+			auto batch_size = [&](size_t b) -> size_t {
+				return std::min(this->batchSize, count - (b * this->batchSize));
+			};
+
+			auto shard_begin = [&](size_t b, size_t k) -> size_t {
+				size_t todo = batch_size(b);
+				return (b * this->batchSize) + (todo * k) / std::min(threads, todo);
+			};
+
+			// with prefetching, the shards for each batch have already been gathered in the background.
+			// (the pass ends when this returns, before anything that the prefetcher uses goes away.)
+			prefetcher_t* pipeline = nullptr;
+			std::optional<typename prefetcher_t::Pass> pass;
+			if(ENABLE_BATCHED() && PREFETCH_DEPTH() > 0)
+			{
+				if(!this->prefetcher)
+					this->prefetcher = std::make_unique<prefetcher_t>(this->prefetched);
+
+				this->prefetched.resize(PREFETCH_DEPTH());
+				for(auto& slot : this->prefetched)
+					slot.resize(threads);
+
+				pipeline = this->prefetcher.get();
+				pass.emplace(pipeline->start(batches, [&](size_t b, std::vector<batch_buffers_t>& slot) {
+					for(size_t k = 0; k < std::min(threads, batch_size(b)); k++)
+						this->load_batch(data, indices, shard_begin(b, k), shard_begin(b, k + 1), slot[k]);
+				}));
+			}
 
-			while(todo > 0)
+			for(size_t b = 0; b < batches; b++)
 			{
-				// in batched mode, the inputs and outputs gain an extra dimension; the first axis is now the batch
-				// size. putting it first obviously allows us to take advantage of broadcasting etc, and the rest of
-				// the code doesn't really need to care.
-				if(ENABLE_BATCHED())
+				size_t todo = batch_size(b);
+				size_t shards = std::min(threads, todo);
+
+				auto slot = (pipeline ? &pipeline->acquire(b) : nullptr);
+				auto train = [&](size_t k) {
+					auto& m = (k == 0 ? model : this->replicas[k - 1]);
+					if(slot) this->train_batch(m, (*slot)[k]);
+					else     this->train_shard(m, data, indices, shard_begin(b, k), shard_begin(b, k + 1), this->buffers[k]);
+				};
+
+				if(shards == 1)
 				{
-					// update the batch dimension to be correct
-					x_shape[0] = todo;
-					y_shape[0] = todo;
-
-					xarr x_batch = xarr::from_shape(x_shape);
-					xarr y_batch = xarr::from_shape(y_shape);
-
-					for(size_t i = 0; i < todo; i++)
-					{
-						xt::view(x_batch, i) = inputs[indices[index]];
-						xt::view(y_batch, i) = targets[indices[index]];
-						index++;
-					}
-
-					{
-						model.feed_training(x_batch);
-						auto out_layer = model.outputLayer();
-						auto prediction = out_layer->compute(/* training: */ true, /* batched: */ true);
-
-						assert(y_batch.shape() == prediction.shape());
-
-						xarr error = this->spec.costFn.derivative(y_batch, prediction);
-						out_layer->backward(error, /* batched: */ true);
-					}
+					train(0);
 				}
 				else
 				{
-					for(size_t i = 0; i < todo; i++)
-					{
-						model.feed_training(inputs[indices[index]]);
-						auto out_layer = model.outputLayer();
-						auto prediction = out_layer->compute(/* training: */ true, /* batched: */ false);
-
-						xarr error = this->spec.costFn.derivative(targets[indices[index]], prediction);
-						out_layer->backward(error, /* batched: */ false);
-
-						index++;
-					}
+					util::parallel_for(shards, train);
+					this->reduce_gradients(model, shards - 1);
 				}
 
-				this->spec.update_weights(todo, model.outputLayer());
+				if(pipeline)
+					pipeline->release(b);
 
-				remaining -= todo;
-				todo = std::min(remaining, this->batchSize);
+				this->spec.update_weights(todo, model);
 			}
 		}
 	};
@@ -162,23 +463,25 @@ namespace znn::optimisers
 	private:
 		CostFn costFn;
 
+		// there's no state to speak of, so updates from several threads can't really conflict.
+		static constexpr bool AsyncSafe = true;
+
 		void setup()
 		{
 			// do nothing
 		}
 
-		virtual void computeDeltas(Layer* layer, xarr& dw, xarr& db) override
+		virtual size_t stateSize() override { return 0; }
+
+		virtual void update(const ParamBlock& blk, double scale) override
 		{
 			// vanilla gradient descent doesn't need to do anything special.
-			(void) layer;
-			(void) dw;
-			(void) db;
+			fused_update(blk, scale, [](size_t, auto dw) { return dw; });
 		}
 
-		void update_weights(size_t samples, Layer* last)
+		void update_weights(size_t samples, Model& model)
 		{
-			last->updateWeights(this, this->learningRate / (double) samples);
-			last->resetDeltas();
+			model.updateWeights(this, this->learningRate / (double) samples);
 		}
 	};
 }
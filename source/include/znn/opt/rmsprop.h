@@ -20,30 +20,39 @@ namespace znn::optimisers
 		}
 
 	private:
-		using LayerGradMap = std::unordered_map<Layer*, xarr>;
-
 		CostFn costFn;
 		const double decay = 0;
 		const double epsilon = 0;
-		LayerGradMap history;
+
+		// the moment estimates aren't meant to be updated out of order; see ENABLE_ASYNC.
+		static constexpr bool AsyncSafe = false;
 
 		void setup()
 		{
 		}
 
-		virtual void computeDeltas(Layer* layer, xarr& dw, xarr& db) override
+		// the state is the moving average of the squared gradients.
+		virtual size_t stateSize() override { return 1; }
+
+		virtual void update(const ParamBlock& blk, double scale) override
 		{
-			xarr& hist = this->history[layer];
-			hist = (this->decay * hist) + ((1 - this->decay) * xt::square(dw));
+			auto decay = scalar_t(this->decay);
+			auto eps = scalar_t(this->epsilon);
+			auto hist = blk.state;
+
+			fused_update(blk, scale, [&](size_t i, auto dw) {
+				using V = decltype(dw);
+
+				V h = (decay * simd::load<V>(hist + i)) + ((scalar_t(1) - decay) * dw * dw);
+				simd::store<V>(hist + i, h);
 
-			dw /= (xt::sqrt(hist) + this->epsilon);
-			(void) db;
+				return dw / (xsimd::sqrt(h) + eps);
+			});
 		}
 
-		void update_weights(size_t samples, Layer* last)
+		void update_weights(size_t samples, Model& model)
 		{
-			last->updateWeights(this, this->learningRate / (double) samples);
-			last->resetDeltas();
+			model.updateWeights(this, this->learningRate / (double) samples);
 		}
 	};
 }
@@ -20,33 +20,45 @@ namespace znn::optimisers
 		}
 
 	private:
-		using LayerVelocityMap = std::unordered_map<Layer*, xarr>;
-
 		CostFn costFn;
 		const double momentum = 0;
-		LayerVelocityMap velocities;
+
+		// the velocity gets updated racily along with the weights, which is fine for hogwild.
+		static constexpr bool AsyncSafe = true;
 
 		void setup()
 		{
 		}
 
 
-		virtual void computeDeltas(Layer* layer, xarr& dw, xarr& db) override
+		// the state is just the velocity.
+		virtual size_t stateSize() override { return 1; }
+
+		virtual void update(const ParamBlock& blk, double scale) override
 		{
 			if(this->momentum > 0)
 			{
-				xarr& vel = this->velocities[layer];
-				vel = (this->momentum * vel) + dw;
+				auto mu = scalar_t(this->momentum);
+				auto vel = blk.state;
+
+				fused_update(blk, scale, [&](size_t i, auto dw) {
+					using V = decltype(dw);
 
-				dw = vel;
-				(void) db;
+					V v = (mu * simd::load<V>(vel + i)) + dw;
+					simd::store<V>(vel + i, v);
+
+					return v;
+				});
+			}
+			else
+			{
+				fused_update(blk, scale, [](size_t, auto dw) { return dw; });
 			}
 		}
 
-		void update_weights(size_t samples, Layer* last)
+		void update_weights(size_t samples, Model& model)
 		{
-			last->updateWeights(this, this->learningRate / (double) samples);
-			last->resetDeltas();
+			model.updateWeights(this, this->learningRate / (double) samples);
 		}
 	};
 }
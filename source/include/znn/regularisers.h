@@ -8,16 +8,22 @@
 
 namespace znn::regularisers
 {
+	// besides forward and derivative, each regulariser reports its derivative as l1 * sign(w) + l2 * w
+	// through l1() and l2(), so the optimiser can apply it in the same sweep as the update.
+
 	struct None
 	{
+		scalar_t l1() const { return 0; }
+		scalar_t l2() const { return 0; }
+
 		xarr forward(const xarr& weights)
 		{
-			return xt::zeros<double>(weights.shape());
+			return xt::zeros<scalar_t>(weights.shape());
 		}
 
 		xarr derivative(const xarr& weights)
 		{
-			return xt::zeros<double>(weights.shape());
+			return xt::zeros<scalar_t>(weights.shape());
 		}
 	};
 
@@ -26,14 +32,17 @@ namespace znn::regularisers
 		L1() = delete;
 		L1(double lambda) : lambda(lambda) { }
 
+		scalar_t l1() const { return scalar_t(lambda); }
+		scalar_t l2() const { return 0; }
+
 		xarr forward(const xarr& weights)
 		{
-			return 0.5 * lambda * xt::abs(weights);
+			return scalar_t(0.5 * lambda) * xt::abs(weights);
 		}
 
 		xarr derivative(const xarr& weights)
 		{
-			return lambda * xt::sign(weights);
+			return scalar_t(lambda) * xt::sign(weights);
 		}
 
 	private:
@@ -45,14 +54,17 @@ namespace znn::regularisers
 		L2() = delete;
 		L2(double lambda) : lambda(lambda) { }
 
+		scalar_t l1() const { return 0; }
+		scalar_t l2() const { return scalar_t(lambda); }
+
 		xarr forward(const xarr& weights)
 		{
-			return 0.5 * lambda * xt::square(weights);
+			return scalar_t(0.5 * lambda) * xt::square(weights);
 		}
 
 		xarr derivative(const xarr& weights)
 		{
-			return lambda * weights;
+			return scalar_t(lambda) * weights;
 		}
 
 	private:
@@ -0,0 +1,176 @@
+// serving.h
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#pragma once
+
+#include "util.h"
+#include "model.h"
+
+namespace znn
+{
+	/*
+		a queue in front of a model, for serving lots of single-sample requests from different threads:
+		a worker thread collects the requests that arrive close together into one batch, and runs them
+		through the batched forward pass (in its own Session), which is a lot cheaper per sample than
+		running them one at a time.
+
+		a batch is run as soon as it has maxBatch requests, or once the oldest request in it has waited
+		for maxWait -- so that's the most latency the batching can add to a request. a maxBatch of 1
+		turns the batching off (but still runs everything on the worker).
+
+		the model needs to outlive the queue, and it can't be trained while the queue is running.
+	*/
+	struct InferenceQueue
+	{
+		InferenceQueue(Model& model, size_t maxBatch = 32, std::chrono::microseconds maxWait = std::chrono::microseconds(200))
+			: maxBatch(maxBatch), maxWait(maxWait), session(model.session()), input_size(model.inputSize()),
+			  output_size(model.outputSize()), output_shape(model.outputShape())
+		{
+			assert(maxBatch > 0);
+
+			this->inputs.resize(maxBatch * this->input_size);
+			this->outputs.resize(maxBatch * this->output_size);
+
+			this->worker = std::thread([this]() { this->worker_loop(); });
+		}
+
+		// finishes all the requests that are still queued before returning.
+		~InferenceQueue()
+		{
+			{
+				std::lock_guard<std::mutex> lk(this->mtx);
+				this->stopping = true;
+			}
+
+			this->wake.notify_all();
+			this->worker.join();
+		}
+
+		InferenceQueue(const InferenceQueue&) = delete;
+		InferenceQueue& operator = (const InferenceQueue&) = delete;
+
+		// queues one input (with the model's input shape, ie. unbatched); the future gets its output.
+		std::future<xarr> submit(const xarr& input)
+		{
+			assert(input.size() == this->input_size);
+
+			auto req = request_t { xt::eval(input), std::promise<xarr>(), clock_t::now() };
+			auto ret = req.result.get_future();
+			{
+				std::lock_guard<std::mutex> lk(this->mtx);
+				assert(!this->stopping);
+
+				this->pending.push_back(std::move(req));
+				this->requests++;
+			}
+
+			// the worker only needs waking for the first request of a batch, or to run a full one.
+			this->wake.notify_one();
+			return ret;
+		}
+
+		// how many requests have been submitted, and how many batches have been run.
+		size_t requestCount() const { std::lock_guard<std::mutex> lk(this->mtx); return this->requests; }
+		size_t batchCount() const { std::lock_guard<std::mutex> lk(this->mtx); return this->batches; }
+
+		const size_t maxBatch;
+		const std::chrono::microseconds maxWait;
+
+	private:
+		using clock_t = std::chrono::steady_clock;
+
+		struct request_t
+		{
+			xarr input;
+			std::promise<xarr> result;
+			clock_t::time_point arrival;
+		};
+
+		Session session;
+
+		size_t input_size = 0;
+		size_t output_size = 0;
+		std::vector<size_t> output_shape;
+
+		// the packed batch, and its outputs; only the worker touches these.
+		aligned_vector inputs;
+		aligned_vector outputs;
+		std::vector<request_t> batch;
+
+		mutable std::mutex mtx;
+		std::condition_variable wake;
+		std::deque<request_t> pending;
+		bool stopping = false;
+
+		size_t requests = 0;
+		size_t batches = 0;
+
+		std::thread worker;
+
+		void worker_loop()
+		{
+			std::unique_lock<std::mutex> lk(this->mtx);
+			while(true)
+			{
+				this->wake.wait(lk, [this]() { return this->stopping || !this->pending.empty(); });
+				if(this->pending.empty())
+					return;
+
+				// wait for the batch to fill up, but not past the oldest request's deadline.
+				auto deadline = this->pending.front().arrival + this->maxWait;
+				this->wake.wait_until(lk, deadline, [this]() {
+					return this->stopping || this->pending.size() >= this->maxBatch;
+				});
+
+				size_t n = std::min(this->maxBatch, this->pending.size());
+				for(size_t i = 0; i < n; i++)
+				{
+					this->batch.push_back(std::move(this->pending.front()));
+					this->pending.pop_front();
+				}
+
+				this->batches++;
+
+				lk.unlock();
+				this->run_batch();
+				lk.lock();
+			}
+		}
+
+		void run_batch()
+		{
+			size_t n = this->batch.size();
+			for(size_t i = 0; i < n; i++)
+			{
+				auto& in = this->batch[i].input;
+				std::copy(in.data(), in.data() + this->input_size, this->inputs.data() + (i * this->input_size));
+			}
+
+			// if anything throws, it goes to the requests that haven't gotten their output yet, instead of
+			// escaping the worker thread (which would terminate the whole process).
+			size_t done = 0;
+			try
+			{
+				this->session.predictBatch(this->inputs.data(), n, this->outputs.data());
+
+				for(; done < n; done++)
+				{
+					auto out = xarr::from_shape(this->output_shape);
+					auto src = this->outputs.data() + (done * this->output_size);
+					std::copy(src, src + this->output_size, out.data());
+
+					this->batch[done].result.set_value(std::move(out));
+				}
+			}
+			catch(...)
+			{
+				auto err = std::current_exception();
+				for(size_t i = done; i < n; i++)
+					this->batch[i].result.set_exception(err);
+			}
+
+			this->batch.clear();
+		}
+	};
+}
@@ -0,0 +1,169 @@
+// shuffle.h
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#pragma once
+
+#include "util.h"
+
+namespace znn
+{
+	/*
+		how GDDriver orders the samples of a Dataset for each pass. a full shuffle is the best for
+		training, but it touches the samples in a completely random order -- which is fine when they're
+		in memory, but when the dataset is bigger than the cache (or is mapped from a file, see io.h),
+		every sample is a cache miss, a TLB miss, and quite possibly a page fault. the other strategies
+		trade a bit of randomness for reading the data in (mostly) sequential runs:
+
+		block:      the samples are split into blocks of `size` consecutive samples, which are visited in
+		            a random order; `window` blocks at a time get their samples shuffled together, so that
+		            a minibatch doesn't just come from one part of the dataset. the working set is about
+		            window * size samples.
+
+		buffer:     the samples are read in order through a buffer of `size` of them, and each one that
+		            comes out is picked at random from the buffer (just like ShuffleBuffer does for a
+		            SampleSource). samples can only move about `size` places from where they were.
+
+		page runs:  the samples are split into runs that fit in `size` bytes (by default, a page), which
+		            are visited in a random order, and each run is read front to back. the runs start at a
+		            random offset on every pass, so they aren't the same groups of samples each time.
+
+		all of them draw from the driver's engine, which is seeded from util::getSeed, so they're just as
+		reproducible as the full shuffle.
+	*/
+	struct Shuffle
+	{
+		enum class Kind { Full, Block, Buffer, PageRuns };
+
+		Kind kind = Kind::Full;
+		size_t size = 0;
+		size_t window = 0;
+
+		static Shuffle full() { return Shuffle(); }
+
+		static Shuffle block(size_t size, size_t window = 8)
+		{
+			assert(size > 0 && window > 0);
+			return Shuffle(Kind::Block, size, window);
+		}
+
+		static Shuffle buffer(size_t size)
+		{
+			assert(size > 0);
+			return Shuffle(Kind::Buffer, size, 0);
+		}
+
+		static Shuffle pageRuns(size_t bytes = 4096)
+		{
+			assert(bytes > 0);
+			return Shuffle(Kind::PageRuns, bytes, 0);
+		}
+
+		// fills indices with a permutation of [0, count), for samples that are rowBytes apart.
+		void permute(std::vector<size_t>& indices, size_t count, size_t rowBytes, std::mt19937& rng) const
+		{
+			indices.resize(count);
+			std::iota(indices.begin(), indices.end(), 0);
+
+			if(count < 2)
+				return;
+
+			switch(this->kind)
+			{
+				case Kind::Full:
+					std::shuffle(indices.begin(), indices.end(), rng);
+					break;
+
+				case Kind::Block:
+					shuffle_blocks(indices, this->size, this->window, rng);
+					break;
+
+				case Kind::Buffer:
+					shuffle_buffered(indices, this->size, rng);
+					break;
+
+				case Kind::PageRuns:
+					shuffle_runs(indices, std::max((size_t) 1, this->size / std::max((size_t) 1, rowBytes)), rng);
+					break;
+			}
+		}
+
+	private:
+		Shuffle() { }
+		Shuffle(Kind kind, size_t size, size_t window) : kind(kind), size(size), window(window) { }
+
+		// the block order is shuffled, then each group of `window` blocks (in that order) is shuffled.
+		static void shuffle_blocks(std::vector<size_t>& indices, size_t size, size_t window, std::mt19937& rng)
+		{
+			size_t count = indices.size();
+			size_t blocks = (count + size - 1) / size;
+
+			auto order = std::vector<size_t>(blocks);
+			std::iota(order.begin(), order.end(), 0);
+			std::shuffle(order.begin(), order.end(), rng);
+
+			size_t k = 0;
+			for(size_t b = 0; b < blocks; b += window)
+			{
+				size_t start = k;
+				for(size_t j = b; j < std::min(blocks, b + window); j++)
+				{
+					for(size_t i = order[j] * size; i < std::min(count, (order[j] + 1) * size); i++)
+						indices[k++] = i;
+				}
+
+				std::shuffle(indices.begin() + start, indices.begin() + k, rng);
+			}
+		}
+
+		// the same thing as ShuffleBuffer, but on the indices.
+		static void shuffle_buffered(std::vector<size_t>& indices, size_t capacity, std::mt19937& rng)
+		{
+			size_t count = indices.size();
+
+			auto buffer = std::vector<size_t>(indices.begin(), indices.begin() + std::min(capacity, count));
+			size_t next = buffer.size();
+
+			for(size_t k = 0; k < count; k++)
+			{
+				size_t i = std::uniform_int_distribution<size_t>(0, buffer.size() - 1)(rng);
+				indices[k] = buffer[i];
+
+				if(next < count)
+				{
+					buffer[i] = next++;
+				}
+				else
+				{
+					buffer[i] = buffer.back();
+					buffer.pop_back();
+				}
+			}
+		}
+
+		// runs of `run` samples, starting from a random phase, in a random order; each run stays in order.
+		static void shuffle_runs(std::vector<size_t>& indices, size_t run, std::mt19937& rng)
+		{
+			size_t count = indices.size();
+			size_t phase = std::uniform_int_distribution<size_t>(0, std::min(run, count) - 1)(rng);
+
+			// the starts of each run; the first one is short (unless the phase is 0).
+			auto starts = std::vector<size_t>();
+			if(phase > 0)
+				starts.push_back(0);
+
+			for(size_t i = phase; i < count; i += run)
+				starts.push_back(i);
+
+			std::shuffle(starts.begin(), starts.end(), rng);
+
+			size_t k = 0;
+			for(auto s : starts)
+			{
+				size_t end = (s == 0 && phase > 0) ? phase : std::min(count, s + run);
+				for(size_t i = s; i < end; i++)
+					indices[k++] = i;
+			}
+		}
+	};
+}
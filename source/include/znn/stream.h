@@ -0,0 +1,156 @@
+// stream.h
+// Copyright (c) 2020, zhiayang
+// Licensed under the Apache License Version 2.0.
+
+#pragma once
+
+#include "util.h"
+#include "dataset.h"
+
+namespace znn
+{
+	/*
+		a source of training samples that gets read front to back, one pass at a time, so the whole
+		dataset never needs to be in memory (eg. it's being read from a file, or generated). GDDriver
+		pulls the samples in chunks; each call to train does one pass, starting with a rewind.
+
+		the samples come out in whatever order the source has them, so for training you usually want
+		to wrap the source in a ShuffleBuffer.
+	*/
+	struct SampleSource
+	{
+		virtual ~SampleSource() { }
+
+		virtual const std::vector<size_t>& inputShape() const = 0;
+		virtual const std::vector<size_t>& targetShape() const = 0;
+
+		// starts a new pass from the first sample.
+		virtual void rewind() = 0;
+
+		// copies the next sample into input and target (which have space for one input and one target,
+		// packed in row-major order). returns false, without copying anything, at the end of the pass.
+		virtual bool next(scalar_t* input, scalar_t* target) = 0;
+	};
+
+	// reads the samples of an in-memory Dataset, in order.
+	struct DatasetSource : SampleSource
+	{
+		DatasetSource(const Dataset& data) : data(data) { }
+
+		virtual const std::vector<size_t>& inputShape() const override { return this->data.inputShape(); }
+		virtual const std::vector<size_t>& targetShape() const override { return this->data.targetShape(); }
+
+		virtual void rewind() override { this->cursor = 0; }
+
+		virtual bool next(scalar_t* input, scalar_t* target) override
+		{
+			if(this->cursor >= this->data.size())
+				return false;
+
+			auto in = this->data.input(this->cursor);
+			auto tg = this->data.target(this->cursor);
+			std::copy(in, in + this->data.inputSize(), input);
+			std::copy(tg, tg + this->data.targetSize(), target);
+
+			this->cursor++;
+			return true;
+		}
+
+	private:
+		const Dataset& data;
+		size_t cursor = 0;
+	};
+
+	/*
+		shuffles another source through a buffer of `capacity` samples: the buffer is filled up from the
+		source, and each sample that comes out is picked at random from it, and its place taken by the
+		next one from the source. so the memory is bounded by the capacity, and the result is a proper
+		shuffle when the capacity is at least the size of the dataset -- otherwise, samples can only move
+		about `capacity` places away from where they were, so make it as large as you can afford.
+
+		the engine is seeded from util::getSeed, and isn't reseeded by rewind, so each pass comes out in
+		a different (but reproducible) order.
+	*/
+	struct ShuffleBuffer : SampleSource
+	{
+		ShuffleBuffer(SampleSource& source, size_t capacity) : source(source), capacity(capacity),
+			rng(util::getSeed())
+		{
+			assert(capacity > 0);
+
+			auto count = [](const std::vector<size_t>& xs) -> size_t {
+				return std::accumulate(xs.begin(), xs.end(), (size_t) 1, std::multiplies<size_t>());
+			};
+
+			this->input_size = count(source.inputShape());
+			this->target_size = count(source.targetShape());
+		}
+
+		virtual const std::vector<size_t>& inputShape() const override { return this->source.inputShape(); }
+		virtual const std::vector<size_t>& targetShape() const override { return this->source.targetShape(); }
+
+		virtual void rewind() override
+		{
+			this->source.rewind();
+			this->count = 0;
+			this->exhausted = false;
+
+			// only allocate this on the first pass, and then just keep it.
+			this->inputs.resize(this->capacity * this->input_size);
+			this->targets.resize(this->capacity * this->target_size);
+		}
+
+		virtual bool next(scalar_t* input, scalar_t* target) override
+		{
+			if(this->inputs.empty())
+				this->rewind();
+
+			while(!this->exhausted && this->count < this->capacity)
+			{
+				if(this->source.next(this->input(this->count), this->target(this->count)))
+					this->count++;
+				else
+					this->exhausted = true;
+			}
+
+			if(this->count == 0)
+				return false;
+
+			size_t i = std::uniform_int_distribution<size_t>(0, this->count - 1)(this->rng);
+			std::copy(this->input(i), this->input(i) + this->input_size, input);
+			std::copy(this->target(i), this->target(i) + this->target_size, target);
+
+			// refill the hole straight from the source, or with the last sample once it's run dry.
+			if(this->exhausted || !this->source.next(this->input(i), this->target(i)))
+			{
+				this->exhausted = true;
+				this->count--;
+
+				if(i != this->count)
+				{
+					std::copy(this->input(this->count), this->input(this->count) + this->input_size, this->input(i));
+					std::copy(this->target(this->count), this->target(this->count) + this->target_size, this->target(i));
+				}
+			}
+
+			return true;
+		}
+
+	private:
+		SampleSource& source;
+		size_t capacity = 0;
+		std::mt19937 rng;
+
+		size_t input_size = 0;
+		size_t target_size = 0;
+
+		size_t count = 0;
+		bool exhausted = false;
+
+		aligned_vector inputs;
+		aligned_vector targets;
+
+		scalar_t* input(size_t i) { return this->inputs.data() + (i * this->input_size); }
+		scalar_t* target(size_t i) { return this->targets.data() + (i * this->target_size); }
+	};
+}
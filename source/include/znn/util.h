@@ -8,7 +8,138 @@
 
 namespace znn
 {
-	using xarr = xt::xarray<double>;
+	// the scalar type used for all tensors (weights, activations, gradients, optimiser state).
+	// build with -DZNN_SCALAR_TYPE=float to train and run models in single precision, which halves
+	// the memory (and bandwidth) of everything and doubles the simd width.
+	#ifndef ZNN_SCALAR_TYPE
+	#define ZNN_SCALAR_TYPE double
+	#endif
+
+	using scalar_t = ZNN_SCALAR_TYPE;
+	using xarr = xt::xarray<scalar_t>;
+
+	// a tensor in memory that belongs to something else (eg. a Session's arena, see MemoryPlan). it has the
+	// same shape type as xarr, so making one doesn't allocate.
+	using xview = decltype(xt::adapt(std::declval<scalar_t*>(), size_t(), xt::no_ownership(), std::declval<xarr::shape_type>()));
+
+	static_assert(std::is_floating_point_v<scalar_t>, "ZNN_SCALAR_TYPE must be a floating-point type");
+
+	// for big flat buffers (eg. the parameter arena in Model), aligned so simd loads never split a cache line.
+	using aligned_vector = std::vector<scalar_t, xsimd::aligned_allocator<scalar_t, XSIMD_DEFAULT_ALIGNMENT>>;
+
+	namespace simd
+	{
+		constexpr size_t width = xsimd::simd_traits<scalar_t>::size;
+
+		// xs[i] = f(xs[i]); vf gets called with full simd batches, and sf with the leftover scalars.
+		template <typename Vf, typename Sf>
+		inline void map(scalar_t* xs, size_t count, Vf&& vf, Sf&& sf)
+		{
+			size_t i = 0;
+			if constexpr (width > 1)
+			{
+				for(; i + width <= count; i += width)
+					xsimd::store_unaligned(xs + i, vf(xsimd::load_unaligned<scalar_t>(xs + i)));
+			}
+
+			for(; i < count; i++)
+				xs[i] = sf(xs[i]);
+		}
+
+		// dst[i] = f(ys[i], err[i]); same deal as map. dst is allowed to alias err.
+		template <typename Vf, typename Sf>
+		inline void zip(const scalar_t* ys, const scalar_t* err, scalar_t* dst, size_t count, Vf&& vf, Sf&& sf)
+		{
+			size_t i = 0;
+			if constexpr (width > 1)
+			{
+				for(; i + width <= count; i += width)
+				{
+					xsimd::store_unaligned(dst + i, vf(xsimd::load_unaligned<scalar_t>(ys + i),
+						xsimd::load_unaligned<scalar_t>(err + i)));
+				}
+			}
+
+			for(; i < count; i++)
+				dst[i] = sf(ys[i], err[i]);
+		}
+
+		// for kernels that stream over several buffers at once (eg. the optimiser updates), where map and zip
+		// don't fit: fn(i, lanes<V>()) gets called for every index i that starts a full simd batch (with
+		// V = batch_t), then for each of the leftover indices (with V = scalar_t). load and store work for both.
+		using batch_t = xsimd::simd_type<scalar_t>;
+
+		template <typename V>
+		struct lanes { using type = V; };
+
+		template <typename Fn>
+		inline void each(size_t count, Fn&& fn)
+		{
+			size_t i = 0;
+			if constexpr (width > 1)
+			{
+				for(; i + width <= count; i += width)
+					fn(i, lanes<batch_t>());
+			}
+
+			for(; i < count; i++)
+				fn(i, lanes<scalar_t>());
+		}
+
+		template <typename V>
+		inline V load(const scalar_t* ptr)
+		{
+			if constexpr (std::is_same_v<V, scalar_t>) return *ptr;
+			else                                       return xsimd::load_unaligned<scalar_t>(ptr);
+		}
+
+		template <typename V>
+		inline void store(scalar_t* ptr, const V& x)
+		{
+			if constexpr (std::is_same_v<V, scalar_t>) *ptr = x;
+			else                                       xsimd::store_unaligned(ptr, x);
+		}
+
+		/*
+			approximate exp, for the `approximate` mode of Sigmoid and TanH. we split x = n*ln(2) + r
+			with |r| <= ln(2)/2, so e^x = 2^n * e^r; 2^n is exact (it just goes in the exponent) and
+			e^r is the degree-6 taylor polynomial. the truncation error is at most |r|^7/7! * e^|r|,
+			which puts the relative error below 2e-7 everywhere. x is clamped so the result stays a
+			normal number (to [-708, 708] for double and [-87, 87] for float).
+
+			this is about the precision of a float, which is plenty for activations, and is a fair
+			bit cheaper than the full-precision exp.
+		*/
+		template <typename T>
+		inline T approx_exp(T x)
+		{
+			using S = scalar_t;
+			constexpr S LOG2E = S(1.4426950408889634);
+			constexpr S LN2 = S(0.6931471805599453);
+			constexpr S LIMIT = S(std::is_same_v<S, float> ? 87 : 708);
+
+			T n;
+			if constexpr (std::is_same_v<T, S>)
+			{
+				x = std::clamp(x, -LIMIT, LIMIT);
+				n = std::nearbyint(x * LOG2E);
+			}
+			else
+			{
+				x = xsimd::min(xsimd::max(x, T(-LIMIT)), T(LIMIT));
+				n = xsimd::nearbyint(x * LOG2E);
+			}
+
+			T r = x - n * LN2;
+			T p = S(1) + r * (S(1) + r * (S(1.0 / 2) + r * (S(1.0 / 6) + r * (S(1.0 / 24)
+				+ r * (S(1.0 / 120) + r * S(1.0 / 720))))));
+
+			if constexpr (std::is_same_v<T, S>)
+				return std::ldexp(p, (int) n);
+			else
+				return xsimd::ldexp(p, xsimd::to_int(n));
+		}
+	}
 
 	namespace util
 	{
@@ -44,6 +175,29 @@ namespace znn
 			xt::random::seed(value);
 		}
 
+		// a 1-dimensional xtensor view of `count` scalars at `ptr`, which it does not own.
+		inline auto adapt(scalar_t* ptr, size_t count)
+		{
+			return xt::adapt(ptr, count, xt::no_ownership(), std::array<size_t, 1> { count });
+		}
+
+		// thin wrapper around blas gemm for contiguous row-major buffers; computes
+		// C = alpha * op(A) * op(B) + beta * C, where op(A) is (m x k), op(B) is (k x n) and C is (m x n).
+		// op(X) is X^T if the corresponding trans flag is set, so the buffers themselves are never transposed.
+		template <typename T>
+		void gemm(bool transA, bool transB, size_t m, size_t n, size_t k, T alpha, const T* a, const T* b,
+			T beta, T* c)
+		{
+			using idx_t = xt::blas_index_t;
+			cxxblas::gemm<idx_t>(cxxblas::StorageOrder::RowMajor,
+				transA ? cxxblas::Transpose::Trans : cxxblas::Transpose::NoTrans,
+				transB ? cxxblas::Transpose::Trans : cxxblas::Transpose::NoTrans,
+				(idx_t) m, (idx_t) n, (idx_t) k,
+				alpha, a, (idx_t) (transA ? m : k),
+				b, (idx_t) (transB ? k : n),
+				beta, c, (idx_t) n);
+		}
+
 		template <typename At, typename Bt, typename R = std::common_type_t<typename At::value_type, typename Bt::value_type>>
 		std::vector<size_t> result_dims(const xt::xexpression<At>& aexp, const xt::xexpression<Bt>& bexp)
 		{
@@ -61,111 +215,414 @@ namespace znn
 		}
 
 
-		// similar to python matmul -- treats dimension > 2 as a stack of matrices.
-		// for two vectors, takes the outer product and returns a matrix.
-		// template <class _Tp = double, typename XC1, typename XC2>
-		template <typename At, typename Bt, typename R = std::common_type_t<typename At::value_type, typename Bt::value_type>>
-		xt::xarray<R> matrix_mul(const xt::xexpression<At>& aexp, const xt::xexpression<Bt>& bexp)
+		/*
+			a fixed set of worker threads that run parallel loops. the calling thread joins in on its own
+			jobs, so a pool of size() == N uses N - 1 extra threads. calling run from inside a job (eg. a
+			parallel gemm inside one shard of a parallel training step) just runs the loop inline, so
+			nesting them can never deadlock or oversubscribe the cores.
+		*/
+		struct ThreadPool
 		{
-			auto&& a = xt::view_eval<At::static_layout>(aexp.derived_cast());
-			auto&& b = xt::view_eval<Bt::static_layout>(bexp.derived_cast());
+			ThreadPool(size_t threads)
+			{
+				for(size_t i = 1; i < threads; i++)
+					this->workers.emplace_back([this]() { this->worker_loop(); });
+			}
 
-			using Arr = xt::xarray<double>;
+			~ThreadPool()
+			{
+				{
+					std::lock_guard<std::mutex> lk(this->mtx);
+					this->stopping = true;
+				}
 
-			if(a.dimension() == 1 && b.dimension() == 1)
+				this->wake.notify_all();
+				for(auto& w : this->workers)
+					w.join();
+			}
+
+			ThreadPool(const ThreadPool&) = delete;
+			ThreadPool& operator = (const ThreadPool&) = delete;
+
+			size_t size() const { return this->workers.size() + 1; }
+
+			// runs fn(i) for every i in [0, count), and returns once they've all finished.
+			template <typename Fn>
+			void run(size_t count, Fn&& fn)
 			{
-				return xt::linalg::outer(a, b);
+				if(count <= 1 || this->workers.empty() || inside_job())
+				{
+					for(size_t i = 0; i < count; i++)
+						fn(i);
+
+					return;
+				}
+
+				// only one job at a time; other threads that want the pool have to wait their turn.
+				std::lock_guard<std::mutex> submit(this->submit_mtx);
+
+				auto func = std::function<void(size_t)>(std::ref(fn));
+				auto job = job_t { &func, count };
+				{
+					std::lock_guard<std::mutex> lk(this->mtx);
+					this->current = &job;
+					this->generation++;
+				}
+
+				this->wake.notify_all();
+				this->work(job);
+
+				// every index has been claimed by now, but the workers might still be running theirs.
+				std::unique_lock<std::mutex> lk(this->mtx);
+				this->current = nullptr;
+				this->done.wait(lk, [this]() { return this->active == 0; });
 			}
-			else if(a.dimension() <= 2 && b.dimension() <= 2)
+
+			// the pool shared by everything in znn, with one thread per core.
+			static ThreadPool& global()
 			{
-				return xt::linalg::dot(a, b);
+				static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+				return pool;
 			}
-			else
+
+		private:
+			struct job_t
 			{
-				if(a.dimension() == b.dimension())
-				{
-					assert(a.shape()[0] == b.shape()[0]);
-					size_t layers = a.shape()[0];
+				const std::function<void(size_t)>* fn;
+				size_t count;
+				std::atomic<size_t> next { 0 };
+			};
 
-					Arr tmp;
-					{
-						Arr a0 = xt::view(a, 0);
-						Arr b0 = xt::view(b, 0);
-						tmp = matrix_mul(std::move(a0), std::move(b0));
-					}
+			static bool& inside_job()
+			{
+				static thread_local bool flag = false;
+				return flag;
+			}
+
+			void work(job_t& job)
+			{
+				bool outer = inside_job();
+				inside_job() = true;
+
+				for(size_t i; (i = job.next.fetch_add(1)) < job.count; )
+					(*job.fn)(i);
 
-					auto out_shape = tmp.shape();
-					out_shape.insert(out_shape.begin(), layers);
+				inside_job() = outer;
+			}
 
-					auto result = Arr::from_shape(out_shape);
-					xt::view(result, 0) = tmp;
+			void worker_loop()
+			{
+				inside_job() = true;
 
-					for(size_t i = 1; i < layers; i++)
+				size_t seen = 0;
+				while(true)
+				{
+					job_t* job = nullptr;
 					{
-						Arr ai = xt::view(a, i);
-						Arr bi = xt::view(b, i);
-						xt::view(result, i) = matrix_mul(std::move(ai), std::move(bi));
+						std::unique_lock<std::mutex> lk(this->mtx);
+						this->wake.wait(lk, [&]() {
+							return this->stopping || (this->current != nullptr && this->generation != seen);
+						});
+
+						if(this->stopping)
+							return;
+
+						seen = this->generation;
+						job = this->current;
+						this->active++;
 					}
 
-					return result;
+					this->work(*job);
+
+					std::lock_guard<std::mutex> lk(this->mtx);
+					if(--this->active == 0)
+						this->done.notify_all();
 				}
-				else if(a.dimension() > b.dimension())
+			}
+
+			std::vector<std::thread> workers;
+
+			std::mutex submit_mtx;
+			std::mutex mtx;
+			std::condition_variable wake;
+			std::condition_variable done;
+
+			job_t* current = nullptr;
+			size_t generation = 0;
+			size_t active = 0;
+			bool stopping = false;
+		};
+
+		// runs fn(i) for every i in [0, count) on the global thread pool.
+		template <typename Fn>
+		void parallel_for(size_t count, Fn&& fn)
+		{
+			ThreadPool::global().run(count, std::forward<Fn>(fn));
+		}
+
+		/*
+			a single-producer, single-consumer pipeline over a ring of slots. a background thread (which
+			stays around from one pass to the next) calls fill(k, slot) for k = 0, 1, ..., count - 1, in that
+			order, and the consumer takes them in the same order with acquire(k) and hands each back with
+			release(k). the producer runs at most slots.size() items ahead, so that's the queue depth (and
+			the slots are reused, so there's no allocation once they've reached their size).
+
+			since there's only one producer and it goes in order, the result is exactly what you'd get
+			by calling fill inline -- it just happens earlier, on another thread.
+
+			each pass is started with start, which returns a Pass; the pass ends when that goes away, and
+			if the consumer didn't take all of the items, the producer stops wherever it got to. the slots
+			can be resized between passes (but not during one).
+		*/
+		template <typename Slot>
+		struct Pipeline
+		{
+			explicit Pipeline(std::vector<Slot>& slots) : slots(slots)
+			{
+				this->producer = std::thread([this]() { this->produce(); });
+			}
+
+			~Pipeline()
+			{
 				{
-					// for now, let's not support broadcasting more than one dimension at once.
-					assert(a.dimension() - 1 == b.dimension());
-					size_t layers = a.shape()[0];
+					std::lock_guard<std::mutex> lk(this->mtx);
+					this->stopping = true;
+				}
 
-					Arr tmp;
-					{
-						Arr a0 = xt::view(a, 0);
-						tmp = matrix_mul(std::move(a0), b);
-					}
+				this->changed.notify_all();
+				this->producer.join();
+			}
+
+			Pipeline(const Pipeline&) = delete;
+			Pipeline& operator = (const Pipeline&) = delete;
 
-					auto out_shape = tmp.shape();
-					out_shape.insert(out_shape.begin(), layers);
+			struct Pass
+			{
+				explicit Pass(Pipeline* pipeline) : pipeline(pipeline) { }
+				~Pass() { if(this->pipeline) this->pipeline->finish(); }
 
-					auto result = Arr::from_shape(out_shape);
-					xt::view(result, 0) = std::move(tmp);
+				Pass(Pass&& other) : pipeline(std::exchange(other.pipeline, nullptr)) { }
+				Pass(const Pass&) = delete;
+				Pass& operator = (const Pass&) = delete;
+				Pass& operator = (Pass&&) = delete;
 
-					for(size_t i = 1; i < layers; i++)
-					{
-						Arr ai = xt::view(a, i);
-						xt::view(result, i) = matrix_mul(std::move(ai), b);
-					}
+			private:
+				Pipeline* pipeline;
+			};
 
-					return result;
+			// starts a pass over `count` items; `fill` (and whatever it refers to) needs to stay alive
+			// until the returned Pass goes away.
+			[[nodiscard]] Pass start(size_t count, std::function<void(size_t, Slot&)> fill)
+			{
+				assert(!this->slots.empty());
+				{
+					std::lock_guard<std::mutex> lk(this->mtx);
+					assert(!this->busy);
+
+					this->count = count;
+					this->fill = std::move(fill);
+					this->produced = 0;
+					this->consumed = 0;
+					this->busy = true;
+					this->passes++;
 				}
-				else
+
+				this->changed.notify_all();
+				return Pass(this);
+			}
+
+			Slot& acquire(size_t k)
+			{
+				assert(k == this->consumed && k < this->count);
+
+				std::unique_lock<std::mutex> lk(this->mtx);
+				this->changed.wait(lk, [&]() { return this->produced > k; });
+
+				return this->slots[k % this->slots.size()];
+			}
+
+			void release(size_t k)
+			{
 				{
-					assert(a.dimension() < b.dimension());
+					std::lock_guard<std::mutex> lk(this->mtx);
+					assert(k == this->consumed);
+					this->consumed = k + 1;
+				}
 
-					// for now, let's not support broadcasting more than one dimension at once.
-					assert(a.dimension() + 1 == b.dimension());
+				this->changed.notify_all();
+			}
+
+		private:
+			// waits for the producer to be done with the current pass (if it isn't finished already,
+			// the producer stops after the item that it's on).
+			void finish()
+			{
+				std::unique_lock<std::mutex> lk(this->mtx);
+				this->cancelled = true;
+				this->changed.notify_all();
 
-					size_t layers = b.shape()[0];
+				this->changed.wait(lk, [&]() { return !this->busy; });
+				this->cancelled = false;
+				this->fill = nullptr;
+			}
 
-					Arr tmp;
+			void produce()
+			{
+				size_t pass = 0;
+				while(true)
+				{
 					{
-						Arr b0 = xt::strided_view(b, { xt::ellipsis(), 0, xt::all(), xt::all() });
-						tmp = matrix_mul(a, std::move(b0));
+						std::unique_lock<std::mutex> lk(this->mtx);
+						this->changed.wait(lk, [&]() { return this->stopping || this->passes != pass; });
+
+						if(this->stopping)
+							return;
+
+						pass = this->passes;
 					}
 
-					auto out_shape = tmp.shape();
-					out_shape.insert(out_shape.begin(), layers);
+					for(size_t k = 0; k < this->count; k++)
+					{
+						{
+							std::unique_lock<std::mutex> lk(this->mtx);
+							this->changed.wait(lk, [&]() {
+								return this->stopping || this->cancelled || k - this->consumed < this->slots.size();
+							});
+
+							if(this->stopping || this->cancelled)
+								break;
+						}
+
+						this->fill(k, this->slots[k % this->slots.size()]);
+
+						{
+							std::lock_guard<std::mutex> lk(this->mtx);
+							this->produced = k + 1;
+						}
 
-					auto result = Arr::from_shape(out_shape);
-					xt::strided_view(result, { xt::ellipsis(), 0, xt::all(), xt::all() }) = std::move(tmp);
+						this->changed.notify_all();
+					}
 
-					for(size_t i = 1; i < layers; i++)
 					{
-						Arr bi = xt::strided_view(b, { xt::ellipsis(), i, xt::all(), xt::all() });
-						xt::strided_view(result, { xt::ellipsis(), i, xt::all(), xt::all() })
-							= matrix_mul(a, std::move(bi));
+						std::lock_guard<std::mutex> lk(this->mtx);
+						this->busy = false;
 					}
 
-					return result;
+					this->changed.notify_all();
 				}
 			}
+
+			std::vector<Slot>& slots;
+			size_t count = 0;
+			std::function<void(size_t, Slot&)> fill;
+
+			std::thread producer;
+			std::mutex mtx;
+			std::condition_variable changed;
+
+			size_t produced = 0;
+			size_t consumed = 0;
+			size_t passes = 0;
+			bool busy = false;
+			bool cancelled = false;
+			bool stopping = false;
+		};
+
+		// batched gemm over contiguous stacks of row-major matrices; for each i < batch, computes
+		// C[i] = alpha * op(A[i % a_count]) * op(B[i % b_count]) + beta * C[i]
+		// so either operand can be broadcast over the leading batch axes of the other without copying it.
+		// openblas has no strided-batched entry point, so we just loop over the batch entries; when each
+		// matrix is small enough that blas won't thread it internally, we spread the entries across threads.
+		template <typename T>
+		void gemm_batched(bool transA, bool transB, size_t m, size_t n, size_t k, T alpha,
+			const T* a, size_t a_count, const T* b, size_t b_count, T beta, T* c, size_t batch)
+		{
+			assert(a_count > 0 && b_count > 0);
+			assert(batch % a_count == 0 && batch % b_count == 0);
+
+			auto one = [&](size_t i) {
+				gemm<T>(transA, transB, m, n, k, alpha, a + (i % a_count) * (m * k), b + (i % b_count) * (k * n),
+					beta, c + i * (m * n));
+			};
+
+			// this is roughly where openblas starts threading a single gemm by itself.
+			constexpr size_t SMALL_GEMM_LIMIT = 64 * 64 * 64;
+
+			if(batch > 1 && m * n * k < SMALL_GEMM_LIMIT)
+			{
+				parallel_for(batch, one);
+			}
+			else
+			{
+				for(size_t i = 0; i < batch; i++)
+					one(i);
+			}
+		}
+
+		// similar to python matmul -- treats dimension > 2 as a stack of matrices.
+		// for two vectors, takes the outer product and returns a matrix.
+		template <typename At, typename Bt, typename R = std::common_type_t<typename At::value_type, typename Bt::value_type>>
+		xt::xarray<R> matrix_mul(const xt::xexpression<At>& aexp, const xt::xexpression<Bt>& bexp)
+		{
+			auto&& a = xt::view_eval<At::static_layout>(aexp.derived_cast());
+			auto&& b = xt::view_eval<Bt::static_layout>(bexp.derived_cast());
+
+			using Arr = xt::xarray<R>;
+
+			if(a.dimension() == 1 && b.dimension() == 1)
+			{
+				return xt::linalg::outer(a, b);
+			}
+			else if(a.dimension() <= 2 && b.dimension() <= 2)
+			{
+				return xt::linalg::dot(a, b);
+			}
+			else
+			{
+				// each operand is a stack of matrices in its last two axes. the batch axes must either
+				// match exactly, or the operand with fewer of them gets broadcast over the extra leading
+				// axes of the other. both operands are used in-place, so they must be row-major and contiguous;
+				// view_eval only copies if they aren't.
+				assert(a.dimension() >= 2 && b.dimension() >= 2);
+
+				auto&& ra = xt::view_eval<xt::layout_type::row_major>(a);
+				auto&& rb = xt::view_eval<xt::layout_type::row_major>(b);
+
+				static_assert(std::is_same_v<typename std::decay_t<decltype(ra)>::value_type, R>
+					&& std::is_same_v<typename std::decay_t<decltype(rb)>::value_type, R>,
+					"batched matrix_mul operands must have the same value type");
+
+				auto a_batch = std::vector<size_t>(ra.shape().begin(), ra.shape().end() - 2);
+				auto b_batch = std::vector<size_t>(rb.shape().begin(), rb.shape().end() - 2);
+
+				auto& longer = (a_batch.size() >= b_batch.size() ? a_batch : b_batch);
+				auto& shorter = (a_batch.size() >= b_batch.size() ? b_batch : a_batch);
+
+				// for now, we only support broadcasting by omitting leading axes (no size-1 axes).
+				assert(std::equal(shorter.begin(), shorter.end(), longer.end() - shorter.size()));
+				(void) shorter;
+
+				size_t m = ra.shape()[ra.dimension() - 2];
+				size_t k = ra.shape()[ra.dimension() - 1];
+				size_t n = rb.shape()[rb.dimension() - 1];
+				assert(rb.shape()[rb.dimension() - 2] == k);
+
+				auto count = [](const std::vector<size_t>& xs) -> size_t {
+					return std::accumulate(xs.begin(), xs.end(), (size_t) 1, std::multiplies<size_t>());
+				};
+
+				auto out_shape = longer;
+				out_shape.push_back(m);
+				out_shape.push_back(n);
+
+				auto result = Arr::from_shape(out_shape);
+				gemm_batched<R>(/* transA: */ false, /* transB: */ false, m, n, k, R(1),
+					ra.data() + ra.data_offset(), count(a_batch),
+					rb.data() + rb.data_offset(), count(b_batch),
+					R(0), result.data(), count(longer));
+
+				return result;
+			}
 		}
 	}
 
@@ -199,5 +656,7 @@ namespace znn
 
 			return i;
 		}
+
+		static std::vector<size_t> vector() { return std::vector<size_t>(sizes.begin(), sizes.end()); }
 	};
 }
@@ -7,6 +7,12 @@
 #include "precompile.h"
 
 #include "util.h"
+#include "stream.h"
+#include "shuffle.h"
+#include "dataset.h"
+#include "memory.h"
+#include "io.h"
+#include "serving.h"
 #include "layers.h"
 #include "optimisers.h"
 #include "activations.h"
@@ -14,9 +20,24 @@
 
 namespace znn
 {
+	// a convenience for small inputs: this packs the samples into a new Dataset on every call, so when
+	// training for several epochs, make the Dataset once and pass that in instead.
 	template <typename Opt>
 	void train(Model& model, const std::vector<xarr>& x, const std::vector<xarr>& y, Opt& optimiser)
 	{
 		optimiser.run(model, x, y);
 	}
+
+	template <typename Opt>
+	void train(Model& model, const Dataset& data, Opt& optimiser)
+	{
+		optimiser.run(model, data);
+	}
+
+	// one pass over a streaming source; see SampleSource.
+	template <typename Opt>
+	void train(Model& model, SampleSource& source, Opt& optimiser)
+	{
+		optimiser.run(model, source);
+	}
 }
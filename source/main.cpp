@@ -9,10 +9,97 @@
 
 #if 1
 
+// a rough benchmark for InferenceQueue: `clients` threads each send one request at a time, back to
+// back, for `millis` milliseconds -- first straight to a Session of their own (so no batching), then
+// through queues with a few different batch sizes. run it with: znn_test serve [clients] [millis]
+static void serving_benchmark(size_t clients, size_t millis)
+{
+	using namespace znn;
+	using clock = std::chrono::steady_clock;
+
+	auto in = layers::Input<shape<64>>();
+	auto a = layers::Dense<256, activations::ReLU>(in);
+	auto b = layers::Dense<256, activations::ReLU>(a);
+	auto c = layers::Dense<16, activations::Sigmoid>(b);
+	auto model = Model(in, c);
+
+	// runs the clients with the given request function, and prints the throughput and latencies.
+	auto measure = [&](const char* name, const std::function<void(size_t, const xarr&)>& request) {
+		auto latencies = std::vector<std::vector<double>>(clients);
+		auto start = clock::now();
+		auto until = start + std::chrono::milliseconds(millis);
+
+		std::vector<std::thread> threads;
+		for(size_t t = 0; t < clients; t++)
+		{
+			// (xtensor's random engine isn't thread-safe, so make the inputs here.)
+			xarr x = xt::random::randn<scalar_t>({ 64 });
+			threads.emplace_back([&, t, x]() {
+				while(clock::now() < until)
+				{
+					auto t0 = clock::now();
+					request(t, x);
+					latencies[t].push_back(std::chrono::duration<double, std::micro>(clock::now() - t0).count());
+				}
+			});
+		}
+
+		for(auto& t : threads)
+			t.join();
+
+		auto secs = std::chrono::duration<double>(clock::now() - start).count();
+
+		std::vector<double> all;
+		for(auto& l : latencies)
+			all.insert(all.end(), l.begin(), l.end());
+
+		std::sort(all.begin(), all.end());
+		auto pct = [&](double p) { return all.empty() ? 0 : all[std::min(all.size() - 1, (size_t) (p * all.size()))]; };
+
+		printf("%-24s %10.0f req/s    p50 %8.1f us    p99 %8.1f us\n", name, all.size() / secs, pct(0.5), pct(0.99));
+	};
+
+	printf("%zu clients, %zu ms each\n", clients, millis);
+
+	auto inference = model.memoryPlan(/* training: */ false);
+	auto training = model.memoryPlan(/* training: */ true);
+	// (training doesn't use its plan; that's only what sharing one arena would take. see Model::memoryPlan.)
+	printf("activations per sample: %zu bytes predicting (%zu naive), %zu training (%zu if planned)\n\n",
+		inference.plannedBytes(), inference.naiveBytes(), training.naiveBytes(), training.plannedBytes());
+
+	{
+		auto sessions = std::vector<Session>();
+		for(size_t t = 0; t < clients; t++)
+			sessions.push_back(model.session());
+
+		measure("session per client", [&](size_t t, const xarr& x) { sessions[t].predict(x); });
+	}
+
+	for(size_t batch : { 1, 8, 32, 128 })
+	{
+		for(size_t wait : { 50, 200, 1000 })
+		{
+			auto queue = InferenceQueue(model, batch, std::chrono::microseconds(wait));
+			measure(zpr::sprint("queue (%zu, %zu us)", batch, wait).c_str(), [&](size_t, const xarr& x) {
+				queue.submit(x).get();
+			});
+
+			if(batch == 1)
+				break;
+		}
+	}
+}
+
 int main(int argc, char** argv)
 {
 	using namespace znn;
 
+	if(argc > 1 && std::string(argv[1]) == "serve")
+	{
+		serving_benchmark(argc > 2 ? std::stoul(argv[2]) : 8, argc > 3 ? std::stoul(argv[3]) : 1000);
+		return 0;
+	}
+
 	optimisers::ENABLE_BATCHED() = (argc > 1 && std::string(argv[1]) == "batch");
 
 	znn::util::setSeed(1);
@@ -42,16 +129,22 @@ int main(int argc, char** argv)
 		inputs.push_back({ 1, 1 }); outputs.push_back({ 0 });
 	}
 
+	auto data = Dataset(inputs, outputs);
 	auto opt = optimisers::Adam<cost::MeanSquare>(4, 0.01);
 	for(size_t i = 0; i < 50; i++)
 	{
 		fprintf(stderr, "\r            \repoch %zu", i + 1);
 		// fprintf(stderr, "\n");
 
-		znn::train(model, inputs, outputs, opt);
+		znn::train(model, data, opt);
 	}
 
-	fprintf(stderr, "\n\n\n");
+	fprintf(stderr, "\n\n");
+
+	// the batchnorm gets folded into the last dense layer, since the first one isn't linear.
+	auto fused = model.optimiseForInference();
+	fprintf(stderr, "inference: %zu layers -> %zu (max error %.3g)\n\n", fused.layersBefore, fused.layersAfter,
+		fused.maxError);
 
 	std::cout << "0 ^ 0  =  " << xt::flatten(model.predict({ 0, 0 })) << "\n";
 	std::cout << "0 ^ 1  =  " << xt::flatten(model.predict({ 0, 1 })) << "\n";